@@ -0,0 +1,81 @@
+/* Helpers shared by the benchmarks. Include after src/main.c. */
+#ifndef LUSH_BENCH_COMMON_H
+#define LUSH_BENCH_COMMON_H
+
+#define BENCH_ROUNDS 5
+
+static const char *bench_prefixes[] = {"", "git-", "lib", "python3.", "x86_64-linux-gnu-", "perl5.36-", "k", "systemd-"};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+static uint64_t rng()
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static void random_name(char *restrict buf)
+{
+  const char *prefix = bench_prefixes[rng() % ARRAY_COUNT(bench_prefixes)];
+  int len = sprintf(buf, "%s", prefix);
+  int tail = 2 + rng() % 10;
+  for (int i = 0; i < tail; i++)
+    buf[len++] = "abcdefghijklmnopqrstuvwxyz0123456789-_"[rng() % 38];
+  buf[len] = '\0';
+}
+
+/* Fake PATH: `dir_count` temporary directories sharing `entries` empty executables.
+ * Sets PATH to them and disables the index cache. `names` gets every name created. */
+typedef struct fake_path {
+  char dirs[8][32];
+  size_t dir_count;
+  char **names;
+  size_t entries;
+} fake_path;
+
+static void fake_path_create(fake_path *restrict f, size_t entries, size_t dir_count)
+{
+  assert(dir_count >= 1 && dir_count <= ARRAY_COUNT(f->dirs));
+  f->dir_count = dir_count;
+  f->entries = entries;
+  f->names = malloc(entries * sizeof(char*));
+  char path[8 * 32 + 8] = "";
+  for (size_t d = 0; d < dir_count; d++)
+  {
+    strcpy(f->dirs[d], "/tmp/lush-bench-XXXXXX");
+    assert(mkdtemp(f->dirs[d]) && "mkdtemp failed.");
+    if (d)
+      strcat(path, PATH_LIST_SEPARATOR);
+    strcat(path, f->dirs[d]);
+  }
+  for (size_t i = 0; i < entries; i++)
+  {
+    char buf[64];
+    random_name(buf);
+    f->names[i] = strdup(buf);
+    char file[128];
+    snprintf(file, sizeof(file), "%s/%s", f->dirs[i % dir_count], buf);
+    int fd = open(file, O_WRONLY | O_CREAT, 0755);
+    if (fd != -1)
+      close(fd);
+  }
+  setenv("PATH", path, 1);
+  setenv("LUSH_INDEX_CACHE", "", 1); // No cache: always scan the fake PATH.
+}
+
+static void fake_path_destroy(fake_path *restrict f)
+{
+  for (size_t i = 0; i < f->entries; i++)
+  {
+    char file[128];
+    snprintf(file, sizeof(file), "%s/%s", f->dirs[i % f->dir_count], f->names[i]);
+    unlink(file);
+    free(f->names[i]);
+  }
+  for (size_t d = 0; d < f->dir_count; d++)
+    rmdir(f->dirs[d]);
+  free(f->names);
+}
+
+#endif
@@ -0,0 +1,97 @@
+/* Compares the exact-lookup structures behind `find_executable` on a fake PATH.
+ * Usage: lookup_bench [entries] [queries]. Defaults: 50000 entries, 2^20 queries, half of them misses.
+ * Reports the best of `BENCH_ROUNDS` passes per structure. */
+#define main lush_main
+#include "../src/main.c"
+#undef main
+#include "bench_common.h"
+
+#define BENCH_DEFAULT_ENTRIES 50000
+#define BENCH_DEFAULT_QUERIES (1 << 20)
+
+// The pre-trie lookup: classic binary search over `offsets`, one `strcmp` per probe.
+static int32_t classic_find(const char *restrict target)
+{
+  int32_t left = 0, right = strings.count;
+  while (left < right)
+  {
+    int32_t m = (left + right) / 2;
+    int cmp = strcmp(target, strings.strings + strings.offsets[m]);
+    if (cmp < 0)
+      right = m;
+    else if (cmp > 0)
+      left = m + 1;
+    else return m;
+  }
+  return -1;
+}
+
+static int32_t trie_exact_find(const char *restrict target)
+{
+  size_t len = strlen(target);
+  int32_t n = trie_find(target, len);
+  if (n == -1)
+    return -1;
+  uint32_t idx = trie.nodes[n].lo;
+  return strings.strings[strings.offsets[idx] + len] == '\0' ? (int32_t)idx : -1;
+}
+
+static void bench(const char *restrict label, int32_t (*find)(const char*), char **queries, size_t q, const int32_t *expected)
+{
+  uint64_t ns = UINT64_MAX;
+  int64_t sum = 0;
+  for (int round = 0; round < BENCH_ROUNDS; round++)
+  {
+    uint64_t start = now_ns();
+    sum = 0;
+    for (size_t i = 0; i < q; i++)
+      sum += find(queries[i]);
+    ns = MIN(ns, now_ns() - start);
+  }
+  for (size_t i = 0; i < q; i++)
+    if (find(queries[i]) != expected[i])
+    {
+      fprintf(stderr, "%s: wrong result for %s\n", label, queries[i]);
+      exit(1);
+    }
+  printf("%-12s %8.1f ns/op  (checksum %lld)\n", label, (double)ns / q, (long long)sum);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t entries = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_ENTRIES;
+  size_t q = argc > 2 ? strtoull(argv[2], NULL, 10) : BENCH_DEFAULT_QUERIES;
+
+  // Fake PATH: one directory of empty executables.
+  fake_path fake;
+  fake_path_create(&fake, entries, 1);
+  char **names = fake.names;
+  pthread_once(&strings_once, build_autocomplete_strings);
+  printf("%u executables, %zu queries\n", strings.count, q);
+
+  // Half hits, half near misses, packed back to back like a stream of command lines.
+  char **queries = malloc(q * sizeof(char*));
+  int32_t *expected = malloc(q * sizeof(int32_t));
+  arena query_strings;
+  arena_init(&query_strings, q * 64);
+  for (size_t i = 0; i < q; i++)
+  {
+    const char *name = names[rng() % entries];
+    size_t len = strlen(name);
+    queries[i] = arena_push(&query_strings, alignof(char), len + 2);
+    memcpy(queries[i], name, len + 1);
+    if (rng() & 1)
+    {
+      queries[i][len] = '~';
+      queries[i][len + 1] = '\0';
+    }
+    expected[i] = classic_find(queries[i]);
+  }
+
+  bench("binary", classic_find, queries, q, expected);
+  bench("trie", trie_exact_find, queries, q, expected);
+  bench("eytzinger", eytzinger_find, queries, q, expected);
+
+  fake_path_destroy(&fake);
+  return 0;
+}
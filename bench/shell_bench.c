@@ -0,0 +1,191 @@
+/* Microbenchmarks for the hot paths of src/main.c on synthetic inputs:
+ * tokenizing, parsing, command lookup and building the executable index.
+ * Usage: shell_bench [executables]. Default: 100000 executables in a fake PATH.
+ * Reports the best of `BENCH_ROUNDS` passes per case, in ns and heap allocations per op. */
+#define main lush_main
+#include "../src/main.c"
+#undef main
+#include "bench_common.h"
+
+#define BENCH_DEFAULT_EXECUTABLES 100000
+#define BENCH_PATH_DIRS 4
+#define BENCH_PIPELINE_STAGES 100
+#define BENCH_QUOTED_LINE_SIZE (64 * KB)
+#define BENCH_QUERIES 4096
+
+/* Every heap allocation is counted, the shell's and libc's alike. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+static atomic_size_t bench_allocs = 0;
+
+void *malloc(size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+  atomic_fetch_add_explicit(&bench_allocs, 1, memory_order_relaxed);
+  return __libc_realloc(p, size);
+}
+
+/* Input of the tokenize / parse cases. `line` is copied to `scratch` before
+ * every tokenize, since tokenizing overwrites it. */
+typedef struct line_case {
+  const char *line;
+  size_t len;
+  char *scratch;
+  arena tokens_arena;
+  arena parse_arena;
+  const tokens *tks;
+} line_case;
+
+typedef struct lookup_case {
+  char **queries;
+  size_t count;
+  int64_t sum; // Keeps the lookups alive.
+} lookup_case;
+
+static void bench(const char *restrict label, void (*op)(void*, size_t), void *ctx, size_t ops)
+{
+  uint64_t ns = UINT64_MAX;
+  size_t allocs = SIZE_MAX;
+  for (int round = 0; round < BENCH_ROUNDS; round++)
+  {
+    size_t allocs_before = atomic_load(&bench_allocs);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < ops; i++)
+      op(ctx, i);
+    ns = MIN(ns, now_ns() - start);
+    allocs = MIN(allocs, atomic_load(&bench_allocs) - allocs_before);
+  }
+  printf("%-32s %12.1f ns/op %10.2f allocs/op\n", label, (double)ns / ops, (double)allocs / ops);
+}
+
+static void op_tokenize(void *ctx, size_t i)
+{
+  line_case *c = ctx;
+  memcpy(c->scratch, c->line, c->len + 1);
+  arena_reset(&c->tokens_arena);
+  c->tks = tokenize(c->scratch, &c->tokens_arena);
+}
+
+static void op_copy(void *ctx, size_t i)
+{
+  line_case *c = ctx;
+  memcpy(c->scratch, c->line, c->len + 1);
+  __asm__ volatile("" : : "r"(c->scratch) : "memory");
+}
+
+static void op_parse(void *ctx, size_t i)
+{
+  line_case *c = ctx;
+  arena_reset(&c->parse_arena);
+  const commands *cmds = parse(c->tks, &c->parse_arena);
+  __asm__ volatile("" : : "r"(cmds) : "memory");
+}
+
+static void op_find_executable(void *ctx, size_t i)
+{
+  lookup_case *c = ctx;
+  c->sum += (intptr_t)find_executable(c->queries[i % c->count]);
+}
+
+static void op_eytzinger_find(void *ctx, size_t i)
+{
+  lookup_case *c = ctx;
+  c->sum += eytzinger_find(c->queries[i % c->count]);
+}
+
+static void op_trie_find(void *ctx, size_t i)
+{
+  lookup_case *c = ctx;
+  // Completion-style prefix: the first three bytes.
+  c->sum += trie_find(c->queries[i % c->count], 3);
+}
+
+// What a PATH change costs: rescan every directory, sort, publish.
+static void op_index_rebuild(void *ctx, size_t i)
+{
+  for (size_t d = 0; d < watch.count; d++)
+    watch.dirs[d].dirty = 1;
+  path_dirs_scan();
+  strings_publish(0);
+}
+
+static void line_case_init(line_case *restrict c, const char *restrict line)
+{
+  c->line = line;
+  c->len = strlen(line);
+  c->scratch = malloc(c->len + 1);
+  arena_virtual_init(&c->tokens_arena, GB);
+  arena_virtual_init(&c->parse_arena, GB);
+  op_tokenize(c, 0);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t executables = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_EXECUTABLES;
+
+  // A long line of quoted words: double quotes with escapes, single quotes, plain words.
+  char *quoted = malloc(BENCH_QUOTED_LINE_SIZE + 64);
+  size_t len = sprintf(quoted, "echo");
+  for (int i = 0; len < BENCH_QUOTED_LINE_SIZE; i++)
+    len += sprintf(quoted + len, i % 3 == 0 ? " \"quoted \\\"word\\\" %d\"" : i % 3 == 1 ? " 'single %d quoted'" : " plain%d", i);
+
+  // A pipeline of `BENCH_PIPELINE_STAGES` stages with a few arguments and a trailing redirection.
+  char *pipeline = malloc(BENCH_PIPELINE_STAGES * 64);
+  len = 0;
+  for (int i = 0; i < BENCH_PIPELINE_STAGES; i++)
+    len += sprintf(pipeline + len, "%scmd%d -x --flag=%d arg", i ? " | " : "", i, i);
+  sprintf(pipeline + len, " > out.txt");
+
+  line_case quoted_case, pipeline_case;
+  line_case_init(&quoted_case, quoted);
+  line_case_init(&pipeline_case, pipeline);
+
+  printf("quoted line: %zu bytes, %zu tokens; pipeline: %d stages, %zu tokens\n",
+         quoted_case.len, quoted_case.tks->c, BENCH_PIPELINE_STAGES, pipeline_case.tks->c);
+  bench("copy quoted line (baseline)", op_copy, &quoted_case, 2000);
+  bench("tokenize quoted line", op_tokenize, &quoted_case, 2000);
+  bench("parse quoted line", op_parse, &quoted_case, 2000);
+  bench("tokenize 100-stage pipeline", op_tokenize, &pipeline_case, 20000);
+  bench("parse 100-stage pipeline", op_parse, &pipeline_case, 20000);
+
+  fake_path fake;
+  fake_path_create(&fake, executables, BENCH_PATH_DIRS);
+  size_t allocs_before = atomic_load(&bench_allocs);
+  uint64_t start = now_ns();
+  pthread_once(&strings_once, build_autocomplete_strings);
+  printf("\n%u executables in %d directories\n", strings.count, BENCH_PATH_DIRS);
+  printf("%-32s %12.1f ns/op %10.2f allocs/op\n", "build_autocomplete_strings (cold)",
+         (double)(now_ns() - start), (double)(atomic_load(&bench_allocs) - allocs_before));
+  bench("index rebuild", op_index_rebuild, NULL, 3);
+
+  // Half hits, half near misses.
+  lookup_case lookups = {.queries = malloc(BENCH_QUERIES * sizeof(char*)), .count = BENCH_QUERIES};
+  for (size_t i = 0; i < BENCH_QUERIES; i++)
+  {
+    const char *name = fake.names[rng() % fake.entries];
+    size_t n = strlen(name);
+    lookups.queries[i] = malloc(n + 2);
+    memcpy(lookups.queries[i], name, n + 1);
+    if (rng() & 1)
+      strcpy(lookups.queries[i] + n, "~");
+  }
+  bench("find_executable", op_find_executable, &lookups, 1 << 20);
+  bench("eytzinger_find", op_eytzinger_find, &lookups, 1 << 20);
+  bench("trie_find (3 byte prefix)", op_trie_find, &lookups, 1 << 20);
+  printf("(checksum %lld)\n", (long long)lookups.sum);
+
+  fake_path_destroy(&fake);
+  return 0;
+}
@@ -0,0 +1,167 @@
+/* End-to-end launch benchmark: drives the shell in script mode through a pipe, once per
+ * `LUSH_SPAWN` backend, and times every line from the write to the arrival of its marker.
+ * Each workload line ends in `&& echo @@M`, so the marker only prints after its commands exit.
+ * Usage: spawn_bench [lines per workload]. Default: 2000, after `BENCH_WARMUP` untimed lines. */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef LUSH_SHELL_PATH
+#error "LUSH_SHELL_PATH must name the shell executable."
+#endif
+
+#define BENCH_DEFAULT_LINES 2000
+#define BENCH_WARMUP 50
+#define BENCH_MARKER "@@M\n"
+#define BENCH_OUTPUT "/tmp/lush-spawn-bench.out"
+
+extern char **environ;
+
+typedef struct workload {
+  const char *name;
+  const char *line; // Without the marker.
+} workload;
+
+static const workload workloads[] = {
+  {"true", "true"},
+  {"8-stage pipeline", "echo x | cat | cat | cat | cat | cat | cat | cat"},
+  {"builtins only", "echo a b c && pwd && type echo"},
+  {"redirections", "true > " BENCH_OUTPUT " && echo x >> " BENCH_OUTPUT " && cat " BENCH_OUTPUT " 2> /dev/null"},
+};
+
+static const char *backends[] = {"posix_spawn", "vfork", "fork"};
+
+/* A running shell: we write its stdin and read its stdout. */
+typedef struct shell {
+  pid_t pid;
+  int in;
+  int out;
+  char buf[64 * 1024];
+  size_t len;
+} shell;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void shell_start(shell *restrict s, const char *restrict backend)
+{
+  int in[2], out[2];
+  int err = pipe2(in, O_CLOEXEC) | pipe2(out, O_CLOEXEC);
+  assert((err == 0) && "Failed `pipe2` for the shell.");
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+  setenv("LUSH_SPAWN", backend, 1);
+  char *argv[] = {"shell", NULL};
+  err = posix_spawn(&s->pid, LUSH_SHELL_PATH, &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err)
+  {
+    fprintf(stderr, "spawn_bench: %s: %s\n", LUSH_SHELL_PATH, strerror(err));
+    exit(1);
+  }
+  close(in[0]);
+  close(out[1]);
+  s->in = in[1];
+  s->out = out[0];
+  s->len = 0;
+}
+
+static void shell_stop(shell *restrict s)
+{
+  close(s->in);
+  close(s->out);
+  waitpid(s->pid, NULL, 0);
+}
+
+// Sends one line and returns the nanoseconds until its marker came back.
+static uint64_t shell_run(shell *restrict s, const char *restrict line, size_t len)
+{
+  uint64_t start = now_ns();
+  for (size_t done = 0; done < len;)
+  {
+    ssize_t n = write(s->in, line + done, len - done);
+    assert(n > 0 && "The shell stopped reading.");
+    done += n;
+  }
+  for (;;)
+  {
+    char *marker = memmem(s->buf, s->len, BENCH_MARKER, sizeof(BENCH_MARKER) - 1);
+    if (marker)
+    {
+      uint64_t ns = now_ns() - start;
+      size_t used = marker + sizeof(BENCH_MARKER) - 1 - s->buf;
+      memmove(s->buf, s->buf + used, s->len - used);
+      s->len -= used;
+      return ns;
+    }
+    // Output before the marker is the workload's own: drop all but a possible marker prefix.
+    if (s->len == sizeof(s->buf))
+    {
+      memmove(s->buf, s->buf + s->len - 8, 8);
+      s->len = 8;
+    }
+    ssize_t n = read(s->out, s->buf + s->len, sizeof(s->buf) - s->len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    assert(n > 0 && "The shell exited early.");
+    s->len += n;
+  }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t lines = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_LINES;
+  uint64_t *latencies = malloc(lines * sizeof(uint64_t));
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%zu lines per workload, %s\n", lines, LUSH_SHELL_PATH);
+  printf("%-12s %-18s %12s %10s %10s %10s\n", "backend", "workload", "lines/s", "p50 us", "p99 us", "p999 us");
+  for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+  {
+    shell s;
+    shell_start(&s, backends[b]);
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+      char line[512];
+      size_t len = snprintf(line, sizeof(line), "%s && echo %s", workloads[w].line, BENCH_MARKER);
+      // The first lines also wait for the executable index.
+      for (int i = 0; i < BENCH_WARMUP; i++)
+        shell_run(&s, line, len);
+      uint64_t total = 0;
+      for (size_t i = 0; i < lines; i++)
+        total += latencies[i] = shell_run(&s, line, len);
+      qsort(latencies, lines, sizeof(uint64_t), compare_u64);
+      printf("%-12s %-18s %12.0f %10.1f %10.1f %10.1f\n", backends[b], workloads[w].name,
+             lines * 1e9 / total,
+             latencies[lines * 50 / 100] / 1e3,
+             latencies[lines * 99 / 100] / 1e3,
+             latencies[lines * 999 / 1000] / 1e3);
+    }
+    shell_stop(&s);
+  }
+  unlink(BENCH_OUTPUT);
+  free(latencies);
+  return 0;
+}
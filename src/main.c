@@ -1,18 +1,37 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <readline/history.h>
 #include <readline/readline.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*=================================================================================================
   DEFINES
@@ -24,25 +43,52 @@
 #define PATH_LIST_SEPARATOR ":"
 #endif
 #define ARENA_DEFAULT_SIZE 8192
+#define ARENA_COMMIT_GRANULE (64 * KB)
+#define REPL_ARENA_RESERVE GB
+#define EXPANSION_RESERVE (REPL_ARENA_RESERVE / 4) // Top of `repl_arena`'s reservation, see `expansions`.
+#define SUBSTITUTION_RESERVE (REPL_ARENA_RESERVE / 4) // Right below `expansions`, see `substitutions`.
+#define SUBSTITUTION_READ_SIZE (64 * KB)
+#define VAR_TABLE_INITIAL_SIZE 256
+#define SCRIPT_READ_SIZE (256 * KB)
+#define OUT_BUFFER_SIZE (64 * KB)
+#define HISTORY_RECENT 1000 // Newest lines handed to Readline before the first prompt.
+#define HISTORY_TEXT_RESERVE (256 * MB)
+#define TRACE_BUFFER_EVENTS 4096
+#define COMMAND_HASH_INITIAL_SIZE 64
+#define DIR_LISTING_SLOTS 32
+#define DIR_LISTING_WAIT_MS 100 // Longest a Tab waits for a listing before giving up.
+#define COMMAND_HASH_TEXT_RESERVE (64 * MB)
+#define COMMAND_HASH_NEGATIVE_TTL (2ull * 1000000000) // ns a "not found" is trusted without looking again.
 #define ARENA_PUSH_TYPE(arena, type) ((type*)arena_push(arena, alignof(type), sizeof(type)))
 #define ALLOCATOR_PUSH_TYPE(type) ARENA_PUSH_TYPE(allocator, type)
 #define MAX_CWD_SIZE 1024
-#define TOKEN_SHIFT 3
+#define TOKEN_SHIFT 4
 #define TOKEN_TYPE_MASK ((1 << TOKEN_SHIFT) - 1)
 #define EXTRACT_TOKEN_TYPE(token) ((token).t & TOKEN_TYPE_MASK)
 #define EXTRACT_TOKEN_PTR(token) ((char*)((token).ptr >> TOKEN_SHIFT))
+#define IS_WORD_TOKEN(token) (((token).t & (GlobWord - 1)) == Word) // `Word` or `GlobWord`, see the asserts below.
 #define CHAR_PTR_TO_TOKEN(ptr) (((intptr_t) (ptr) << TOKEN_SHIFT) | Word)
 #define EXTENDED_ASCII 256
 #define TRIE_ARRAY_SIZE EXTENDED_ASCII
 #define ROUND_UP_INT_DVISION(numer, denom) (((numer) + (denom) - 1) / (denom))
 #define ARRAY_COUNT(arr) (sizeof(arr) / sizeof((arr)[0]))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define LSB64(n) __builtin_ctzll(n)
 #define MSB64(n) (63 - __builtin_clzll(n))
 #define KB (1 << 10)
 #define MB (KB << 10)
 #define GB (MB << 10)
 #define ALIGN_UP(n, alignment) (((n) + (alignment) - 1) & ~((alignment) - 1))
+#define SPAWN_STACK_SIZE (64 * KB)
+#define PATH_DIR_ARENA_RESERVE (256 * MB)
+#define PATH_SCAN_MAX_WORKERS 8
+#define GETDENTS_BUFFER_SIZE (256 * KB)
+#define RADIX_SORT_CUTOFF 32
+#define MAX_JOBS 256
+#define INDEX_CACHE_MAGIC 0x4c555332 // "LUS2"
+#define INDEX_CACHE_NAME "lush-path-index"
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
 // +1 for null termination of `args->v`s.
 #define ADVANCE_ARGS(a) (args*)((char*)(a) + sizeof(args) + ((a)->c + 1) * sizeof(char*))
 
@@ -57,6 +103,14 @@ enum Builtins {
   Type,
   Exit,
   History,
+  Jobs,
+  Wait,
+  FG,
+  BG,
+  Time,
+  Hash,
+  Export,
+  Unset,
   Builtins_Size,
 };
 
@@ -71,10 +125,48 @@ enum Token_Type {
   Pipe,
   Sequential,
   Background,
+  GlobWord, // A word with unquoted *, ? or [: expanded against the file system by `parse`.
   Token_Type_Size,
 };
 
+/* How external commands are launched. Picked with `LUSH_SPAWN`. */
+enum Spawn_Backend {
+  Spawn_Posix, // `posix_spawn`, file actions carry the fd plumbing.
+  Spawn_Vfork, // `clone(CLONE_VM | CLONE_VFORK)` on a private stack.
+  Spawn_Fork,  // Classic `fork` + `execve`.
+  Spawn_Backend_Size,
+};
+
+/* Load state of a `dir_listing` slot. */
+enum Listing_State {
+  Listing_Free,
+  Listing_Queued,  // Waiting for the worker to load or revalidate it.
+  Listing_Loading,
+  Listing_Ready,
+};
+
+/* Per process state of a background job, written by `sigchld_handler`. */
+enum Job_State {
+  Job_Running,
+  Job_Stopped,
+  Job_Done,
+};
+
+/* Lexer byte classes, see `char_classes`. */
+enum Char_Class {
+  Class_Word, // Copied as is.
+  Class_Space,
+  Class_Operator,
+  Class_Single_Quote,
+  Class_Double_Quote,
+  Class_Backslash,
+  Class_Dollar, // $ and `: expansions.
+  Class_Glob, // *, ? and [.
+  Class_End,
+};
+
 static_assert(Token_Type_Size - 1 <= TOKEN_TYPE_MASK, "Token tag does not fit into its mask. Expand shift if possible.");
+static_assert(Word == 0 && GlobWord + 1 == Token_Type_Size && (GlobWord & (GlobWord - 1)) == 0, "`IS_WORD_TOKEN` tests the bits below `GlobWord`.");
 
 /*=================================================================================================
   UNIONS
@@ -97,10 +189,12 @@ typedef struct str {
   size_t len;
 } str;
 
-/* Bump allocator. */
+/* Bump allocator. Either a fixed `malloc` block, or a virtual reservation
+ * (`reserved != 0`) whose first `capacity` bytes are committed on demand. */
 typedef struct arena {
   size_t len;
   size_t capacity;
+  size_t reserved;
   char *data;
 } arena;
 
@@ -122,6 +216,8 @@ typedef struct args {
   size_t c;
   // Includes both pointer and tag.
   token redirection;
+  enum Token_Type link; // How it joins the next command: `Pipe`, `Sequential` or `Background`.
+  int timed;            // First command of a pipeline prefixed with `time`.
   char *v[];
 } args;
 
@@ -140,7 +236,8 @@ typedef struct commands {
  *    sizeof(int32_t) * 2 * count // offsets for strings
  *  );`
  * Destroying this is as simple as `free(strings.strings)`
- * and setting fields to 0.
+ * and setting fields to 0, unless it was mapped from the
+ * index cache, see `strings_release`.
  */
 typedef struct permanent_strings {
   // Points to the first executable / built-in string in lexicographic order,
@@ -152,21 +249,428 @@ typedef struct permanent_strings {
   // `offsets[2 * count]` is out of bounds.
   int32_t *offsets;
   uint32_t count;
+  size_t size; // Bytes from `strings` to the end of `offsets`.
+  void *map;   // Whole cache file mapping, NULL for a malloc'ed block.
+  size_t map_size;
 } permanent_strings;
 
+/* Path-compressed trie node over the sorted names in `strings`.
+ * Covers names [lo, hi), which share their first `depth` bytes.
+ * Its edge label runs from the parent's `depth` to its own in `strings + offsets[lo]`,
+ * so labels cost no memory. Children are contiguous and sorted by their first label byte. */
+typedef struct trie_node {
+  uint32_t lo;
+  uint32_t hi;
+  uint32_t depth;
+  uint32_t first_child;
+  uint32_t child_count; // 0 for leaves.
+} trie_node;
+
+/* Trie built next to `strings`. `labels[n]` is the first edge byte of node `n`,
+ * kept apart so choosing a child scans a few contiguous bytes. Node 0 is the root. */
+typedef struct strings_trie {
+  trie_node *nodes;
+  uint8_t *labels;
+  uint32_t count;
+} strings_trie;
+
+/* First 16 bytes of a name, big-endian and NUL padded: integer order matches `strcmp` order. */
+typedef struct prefix_key {
+  uint64_t hi;
+  uint64_t lo;
+} prefix_key;
+
+/* `strings` names in Eytzinger (BFS) order for exact lookups. Probes compare
+ * `keys[k]` and only names tied on all 16 key bytes touch the string block.
+ * `idx[k]` maps back to the sorted index. 1-based: `keys[0]` is unused. */
+typedef struct strings_eytzinger {
+  prefix_key *keys;
+  uint32_t *idx;
+  uint32_t count;
+} strings_eytzinger;
+
+/* Header of the on-disk copy of `strings`, followed by
+ * PATH (NUL terminated), one `index_cache_dir` per PATH directory,
+ * the block itself at `block_offset`, and every directory's `names` back to back
+ * at `names_offset`. Valid while PATH, the builtins and every directory's mtime are unchanged. */
+typedef struct index_cache_header {
+  uint32_t magic;
+  uint32_t count;
+  uint64_t builtins_hash;
+  uint64_t path_len;
+  uint64_t dir_count;
+  uint64_t block_offset;
+  uint64_t block_size;
+  uint64_t names_offset;
+  uint64_t names_size;
+} index_cache_header;
+
+typedef struct index_cache_mtime {
+  int64_t sec;  // -1 when the directory could not be opened.
+  int64_t nsec;
+} index_cache_mtime;
+
+/* A PATH directory as of the cache: its mtime and its range of the names. */
+typedef struct index_cache_dir {
+  index_cache_mtime mtime;
+  uint64_t names_size;
+  uint64_t count;
+} index_cache_dir;
+
+/* File descriptor plumbing for a spawned child.
+ * `in` / `out` are dup'd onto stdin / stdout (-1 inherits the shell's),
+ * `redirection` is a file redirection (`Word` for none), opened by the shell into
+ * `redirect_fd` and dup'd onto `redirect_target` in the child,
+ * and `close` lists descriptors the child must not keep.
+ * `pgid` is the process group to join: 0 stays in the shell's, -1 leads a new one.
+ * `status` is set when `spawn_command` fails: 1 for the redirection, 127 otherwise. */
+typedef struct spawn_fds {
+  int in;
+  int out;
+  token redirection;
+  int redirect_fd;
+  int redirect_target;
+  const int *close;
+  int close_count;
+  pid_t pgid;
+  int status;
+} spawn_fds;
+
+/* Everything a `Spawn_Vfork` child needs. Shared with the parent through CLONE_VM. */
+typedef struct spawn_plan {
+  const char *path;
+  char *const *argv;
+  char *const *envp;
+  const spawn_fds *fds;
+  sigset_t mask;    // Parent's signal mask, restored in the child before exec.
+  volatile int err; // Set by the child when it cannot exec.
+} spawn_plan;
+
+/* One PATH directory and the executables last seen in it. */
+typedef struct path_dir {
+  const char *path;
+  arena names; // NUL separated executable names, in `readdir` order.
+  uint32_t count;
+  index_cache_mtime mtime; // As of the last scan, or of the cache check.
+  int wd;      // inotify watch descriptor, -1 when not watched.
+  int dirty;   // Changed since the last scan.
+} path_dir;
+
+/* Every PATH directory behind `strings`, kept so a change rescans only its own directory. */
+typedef struct path_watch {
+  char *path; // Mutable copy of PATH, split in place by `dirs[i].path`.
+  path_dir *dirs;
+  size_t count;
+  int fd;     // inotify instance, -1 when unavailable.
+  uint32_t generation; // Bumped by every rescan: older `hash` entries resolve again.
+} path_watch;
+
+/* One process of a background job. */
+typedef struct job_process {
+  pid_t pid; // -1 when it could not be launched.
+  volatile sig_atomic_t state; // `Job_State`
+  volatile sig_atomic_t status; // Wait status, once `Job_Done`.
+} job_process;
+
+/* A background pipeline or `&&` list in its own process group. Slot `n` of `jobs` is job `%n+1`.
+ * `sigchld_handler` reads the table: the main thread blocks SIGCHLD to change it. */
+typedef struct job {
+  job_process *processes; // NULL for a free slot.
+  int count;
+  pid_t pgid;
+  char *command;          // Shown by `jobs`, `fg` and notices.
+  enum Job_State notified; // Last state reported before a prompt.
+} job;
+
+/* Posting list of one trigram: the ascending `lines` indices containing it, delta + LEB128 encoded. */
+typedef struct trigram_posting {
+  uint32_t key;   // Its three bytes, UINT32_MAX for a free slot.
+  uint32_t count;
+  uint32_t last;  // Newest index in `data`.
+  uint32_t len;
+  uint32_t capacity;
+  uint8_t *data;
+} trigram_posting;
+
+/* HISTFILE mapped read-only at startup. Its line index is built on a background
+ * thread and joined on first use; lines typed before that wait in `text`.
+ * Nothing is parsed into `HIST_ENTRY`s but the newest `HISTORY_RECENT` lines. */
+typedef struct history_store {
+  char *map;          // HISTFILE as of startup, NULL when missing or empty.
+  size_t map_size;
+  str *lines;         // Oldest first. Lines dropped by erasedups have `data == NULL`.
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t visible;   // Lines not dropped.
+  uint32_t *set;      // erasedups: open addressing on line hashes, index into `lines` or UINT32_MAX.
+  uint32_t set_size;  // Power of two, or 0.
+  uint32_t set_used;
+  trigram_posting *grams; // Open addressing on trigram, kept current with `lines`.
+  uint32_t gram_size;     // Power of two.
+  uint32_t gram_used;
+  arena text;         // NUL terminated copies of this session's lines.
+  uint32_t pending;   // Lines in `text` not yet in `lines`, since the index is not joined.
+  str last;           // Newest line, for ignoredups.
+  pthread_t loader;
+  int loading;        // `loader` still has to be joined.
+  int ignoredups;
+  int ignorespace;
+  int erasedups;
+} history_store;
+
+/* One complete (`"ph":"X"`) event of the Chrome trace. */
+typedef struct trace_event {
+  const char *name;  // Phase, a string literal.
+  char detail[32];   // Command or target, truncated. Empty for none.
+  uint64_t start;    // `now_ns` clock.
+  uint64_t end;
+  pid_t tid;
+} trace_event;
+
+/* `LUSH_TRACE=file`: events gather in `events` under `lock` and are appended to `fd`
+ * as Chrome trace JSON whenever it fills up, and at exit. */
+typedef struct trace_log {
+  trace_event *events; // NULL when tracing is off: the only thing probes look at.
+  size_t count;
+  int fd;
+  int written;         // Events already in the file, for the JSON commas.
+  int closed;
+  pid_t pid;           // Forked children must not flush the buffer they inherited.
+  pthread_mutex_t lock;
+} trace_log;
+
+/* What `time` reports for one pipeline stage. Children fill `usage` from `wait4`,
+ * in-process builtins from `RUSAGE_THREAD` deltas. */
+typedef struct stage_time {
+  const char *name;
+  uint64_t start; // `now_ns` clock.
+  uint64_t end;
+  struct rusage usage;
+} stage_time;
+
+/* Where `find_executable` last resolved a command name, or that it did not.
+ * A hit is trusted only while the file keeps its inode, mtime and mode. */
+typedef struct hashed_command {
+  const char *name;  // NULL for a free slot.
+  const char *path;  // NULL for a negative entry.
+  uint64_t ino;
+  struct statx_timestamp mtime;
+  uint16_t mode;
+  uint32_t hits;
+  uint32_t generation; // `watch.generation` when resolved.
+  uint64_t expires;    // Negative entries: `now_ns` deadline.
+} hashed_command;
+
+/* Name to path cache in front of the PATH index, open addressing on `hash_bytes`.
+ * Entries are updated in place and only dropped all at once by `hash -r`. */
+typedef struct command_hash {
+  hashed_command *slots;
+  uint32_t size; // Power of two, or 0.
+  uint32_t used;
+  arena text;    // Names and paths of `slots`.
+} command_hash;
+
+/* A shell variable, kept as its `NAME=value` environment string. */
+typedef struct shell_var {
+  char *entry;       // NULL for a free slot.
+  uint32_t name_len;
+  int exported;
+} shell_var;
+
+/* Every shell and environment variable, open addressing on the name with backward shift
+ * deletion. `envp` lists the exported entries for exec, rebuilt after a change. */
+typedef struct var_table {
+  shell_var *slots;
+  uint32_t size;     // Power of two, or 0 before `vars_init`.
+  uint32_t used;
+  char **envp;       // NULL when stale.
+} var_table;
+
+/* Sorted entries of one directory as of `mtime`. Laid out like `permanent_strings`:
+ * NUL terminated names in `strings`, followed by `offsets` into them, in one block. */
+typedef struct dir_listing {
+  char *path;        // Absolute, the key. NULL for a free slot.
+  index_cache_mtime mtime;
+  char *strings;     // NULL until the first load.
+  int32_t *offsets;
+  uint32_t count;
+  uint64_t used;     // `now_ns` of the last request, for eviction.
+  enum Listing_State state;
+} dir_listing;
+
+/* Listings shared by argument completion and the worker that loads them. */
+typedef struct dir_listings {
+  dir_listing slots[DIR_LISTING_SLOTS];
+  char typed[PATH_MAX]; // Directory last prefetched while typing.
+  pthread_mutex_t lock;
+  pthread_cond_t queued; // The worker waits for `Listing_Queued` slots.
+  pthread_cond_t ready;  // Completion waits for a load.
+  pthread_once_t once;   // Starts the worker.
+} dir_listings;
+
 typedef struct temp_entry {
-  char *name;
-  char *full_path; // NULL for built-in
+  const char *name;
+  const path_dir *dir; // NULL for built-in
 } temp_entry;
 
+/* A word being lexed, see `tokenize`. */
+typedef struct word_lexer {
+  char *start;
+  char *w;      // Write pointer.
+  int expanded; // Being built in `expansions`: grow it before every write.
+  int quoted;   // Kept even when empty.
+  int glob;     // Has an unquoted *, ? or [.
+  int escaped;  // Has a backslash before a literal *, ?, [ or \, for `glob_compile`.
+} word_lexer;
+
+enum Glob_Op {
+  Glob_Literal,
+  Glob_Any,   // ?
+  Glob_Star,  // *
+  Glob_Class, // [...]
+};
+
+/* One step of a compiled path component, see `glob_match`. */
+typedef struct glob_op {
+  enum Glob_Op op;
+  uint32_t len;        // `Glob_Literal` bytes at `literal`.
+  const char *literal;
+  uint64_t set[4];     // `Glob_Class` bytes that match.
+} glob_op;
+
+/* Path component of a pattern, compiled once and matched against every directory entry. */
+typedef struct glob_component {
+  glob_op *ops;
+  uint32_t count;
+  int literal;         // No metacharacters: `ops[0]` names the entry, no directory is read.
+  int dot;             // Starts with a literal '.', so it may match hidden entries.
+  const char *suffix;  // Literal tail after the last *, checked before running the ops.
+  uint32_t suffix_len;
+} glob_component;
+
+/* Pathname expansion of one word, see `glob_expand`. */
+typedef struct glob_state {
+  glob_component *components;
+  uint32_t count;
+  int dirs_only;       // The pattern ends in '/'.
+  char path[PATH_MAX]; // Directory being read, with a trailing '/'.
+  char *buf;           // `getdents64` buffer.
+  arena scratch;       // Compiled patterns, names and sort space. Reset per word.
+  arena *allocator;    // Receives a pointer per match.
+  size_t matches;
+} glob_state;
+
 /*=================================================================================================
   FUNCTIONS
 =================================================================================================*/
 
 static const char* find_executable(const char *restrict target);
-static const tokens* tokenize(arena *restrict allocator);
+static void execute_line(char *restrict line, arena *restrict repl_arena);
+static void execute_commands(const commands *restrict cmds, arena *restrict allocator);
+static const args* execute_list(const args *restrict a, int count, int in_job, arena *restrict allocator);
+static const args* execute_list_background(const args *restrict a, int count, arena *restrict allocator);
+static void run_script(int fd, arena *restrict repl_arena);
+static size_t run_script_lines(char *restrict buf, size_t len, arena *restrict repl_arena);
+static void run_script_line(char *restrict line, arena *restrict repl_arena);
+static const tokens* tokenize(char *restrict p, arena *restrict allocator);
+static char* lex_operator(char *restrict p, enum Token_Type *restrict t);
+static char* lex_scan(char *restrict p, enum Char_Class stop);
+static const char* lex_parameter(char *restrict *p);
+static void lex_room(const char *restrict w, size_t n);
+static const char* lex_expansion(word_lexer *restrict x, char *restrict *p);
+static char* lex_substitution_end(char *restrict p);
+static const char* lex_substitute(word_lexer *restrict x, char *restrict inner);
+static void substitution_run(const commands *restrict cmds);
+static void substitution_read(int fd);
+static size_t lex_split(word_lexer *restrict x, const char *restrict v, arena *restrict allocator);
+static void lex_expand(word_lexer *restrict x);
+static inline void lex_put(word_lexer *restrict x, const char *s, size_t n);
+static inline void lex_literal(word_lexer *restrict x, char c);
+static void lex_value(word_lexer *restrict x, const char *restrict v);
+static inline int lex_finish(word_lexer *restrict x, arena *restrict allocator);
+static char* glob_unescape(char *restrict s);
+static size_t glob_expand(char *restrict pattern, arena *restrict allocator);
+static void glob_compile(glob_component *restrict c, const char *restrict s, size_t n, arena *restrict scratch);
+static int glob_match(const glob_component *restrict c, const char *restrict name, size_t len);
+static void glob_push(glob_state *restrict g, size_t len);
+static void glob_walk(glob_state *restrict g, size_t len, uint32_t k);
 static const commands* parse(const tokens *restrict T, arena *restrict allocator);
+static const commands* parse_error(commands *restrict cmds, enum Token_Type link);
+static const commands* parse_redirect_error(commands *restrict cmds);
 static const args* execute_single_command(const args *restrict a, arena *restrict allocator);
+static const args* execute_pipeline(const args *restrict a, int pipeline_length, int background, arena *restrict allocator);
+static int find_builtin(const char *restrict name);
+static void run_builtin(int builtin, const args *restrict a, arena *restrict allocator);
+static void out_write(const char *restrict s, size_t n);
+static void out_printf(const char *restrict format, ...);
+static void out_flush();
+static void out_send(const char *restrict s, size_t n);
+static int write_all(int fd, const char *restrict s, size_t n);
+static pid_t spawn_command(const char *restrict path, char *const argv[], spawn_fds *restrict fds);
+static int spawn_redirect_open(spawn_fds *restrict fds);
+static int spawn_child_setup(const spawn_fds *restrict fds);
+static int spawn_vfork_child(void *plan);
+static int redirection_target(token redirection, int *restrict flags);
+static int redirect_shell(token redirection, int *restrict target_fd);
+static void redirect_restore(int saved_fd, int target_fd);
+static int pipe_open(int fds[2]);
+static int wait_status(int wstat);
+static void stage_time_self(stage_time *restrict t, int done);
+static int stages_reap(const pid_t *restrict pids, stage_time *restrict times, int count, arena *restrict allocator);
+static void time_report(const stage_time *restrict times, int count, uint64_t start);
+
+static void sigchld_handler(int sig);
+static void jobs_reap();
+static int job_slot();
+static void job_add(int j, const args *restrict a, int stages, pid_t pgid, const pid_t *restrict pids, int count);
+static void job_remove(int j);
+static enum Job_State job_state(int j);
+static void job_wait(int j, int foreground);
+static int job_find(const char *restrict spec, int by_pid);
+static int job_current();
+static void job_print(int j, enum Job_State state);
+static void jobs_notify();
+
+static const char* history_store_path();
+static void history_store_start(const char *restrict path);
+static void* history_store_index(void*);
+static void history_store_join();
+static int history_store_add(const char *restrict line);
+static void history_store_insert(str line);
+static uint32_t* history_store_slot(str line);
+static void history_store_save(const char *restrict path, uint32_t n, int truncate);
+static void history_store_import(const char *restrict path);
+static void history_store_grams(uint32_t i);
+static trigram_posting* trigram_slot(uint32_t key);
+static uint32_t history_store_search(const char *restrict pattern, size_t len, uint32_t before, uint32_t *restrict out, uint32_t max);
+static int history_search_key(int count, int key);
+static uint64_t hash_bytes(const char *restrict s, size_t len);
+
+static const char* command_hash_find(const char *restrict name);
+static hashed_command* command_hash_slot(const char *restrict name);
+static const char* command_resolve(const char *restrict name, char *restrict buf, struct statx *restrict st);
+static int command_stat(const char *restrict path, struct statx *restrict st);
+static void command_hash_store(hashed_command *restrict e, const char *restrict path, const struct statx *restrict st);
+static void command_hash_clear();
+
+static void vars_init();
+static shell_var* var_slot(const char *restrict name, size_t len);
+static const char* var_lookup(const char *restrict name, size_t len);
+static const char* var_get(const char *restrict name);
+static void var_store(const char *restrict name, size_t len, const char *restrict value, int exported);
+static void var_set(const char *restrict name, size_t len, const char *restrict value, int exported);
+static void var_unset(const char *restrict name, size_t len);
+static char** vars_envp();
+static size_t var_name_len(const char *restrict s);
+static int var_assignments(const args *restrict a);
+static int var_assignments_only(const args *restrict a);
+static void path_index_rebuild();
+
+static void trace_start(const char *restrict path);
+static uint64_t trace_begin();
+static void trace_end(const char *restrict name, uint64_t start, const char *restrict detail);
+static void trace_flush();
+static void trace_close();
 
 static void builtin_cd(const args *restrict a, arena *restrict allocator);
 static void builtin_pwd(const args *restrict a, arena *restrict allocator);
@@ -174,38 +678,115 @@ static void builtin_echo(const args *restrict a, arena *restrict allocator);
 static void builtin_type(const args *restrict a, arena *restrict allocator);
 static void builtin_exit(const args *restrict a, arena *restrict allocator);
 static void builtin_history(const args *restrict a, arena *restrict allocator);
+static void builtin_jobs(const args *restrict a, arena *restrict allocator);
+static void builtin_wait(const args *restrict a, arena *restrict allocator);
+static void builtin_fg(const args *restrict a, arena *restrict allocator);
+static void builtin_bg(const args *restrict a, arena *restrict allocator);
+static void builtin_time(const args *restrict a, arena *restrict allocator);
+static void builtin_hash(const args *restrict a, arena *restrict allocator);
+static void builtin_export(const args *restrict a, arena *restrict allocator);
+static void builtin_unset(const args *restrict a, arena *restrict allocator);
 
 static int is_whitespace(char c);
 static int is_decimal_num(const char *restrict c);
 static char* skip_spaces(char *restrict p);
 
 static void arena_init(arena *restrict arena, size_t size);
+static void arena_virtual_init(arena *restrict arena, size_t reserve);
+static void arena_commit(arena *restrict arena, size_t size);
+static void arena_trim(arena *restrict arena, size_t keep);
 static void arena_exponential_init(arena_exponential *restrict arena, size_t size);
 static void arena_destroy(arena *restrict arena);
-static void* arena_push(arena *restrict arena, size_t alignment, size_t size);
+static inline void* arena_push(arena *restrict arena, size_t alignment, size_t size);
 static void* arena_exponential_push(arena_exponential *restrict a, size_t alignment, size_t size);
 static void arena_reset(arena *restrict arena);
 
 static void build_autocomplete_strings();
-static int temp_entry_cmp(const void *a, const void *b);
-static int32_t strings_binary_search(const char *restrict target);
+static void path_dirs_scan();
+static void* path_scan_worker(void *next);
+static void path_dir_scan(path_dir *restrict d, char *restrict buf);
+static void path_watch_poll();
+static void strings_publish(uint64_t scan_ns);
+static void temp_entry_radix_sort(temp_entry *restrict e, temp_entry *restrict tmp, size_t n, size_t depth);
+static uint64_t now_ns();
+static void strings_release(permanent_strings *restrict s);
+static int index_cache_path(char *restrict buf, size_t size);
+static int index_cache_load();
+static void index_cache_store();
+static uint64_t builtins_hash();
+static index_cache_mtime dir_mtime(int fd, const char *restrict path);
+static void strings_ready();
+static void strings_derive();
+static void trie_build();
+static uint32_t trie_build_node(uint32_t n, uint32_t lo, uint32_t hi);
+static int32_t trie_find(const char *restrict prefix, size_t len);
+static void eytzinger_build();
+static uint32_t eytzinger_fill(uint32_t i, uint32_t k);
+static int32_t eytzinger_find(const char *restrict target);
+static prefix_key prefix_key_of(const char *restrict s);
 static void* init_once(void*);
 
 static char** attempted_completion_function(const char *restrict text, int start, int end);
-static char* completion_matches_generator(const char *restrict text, int state);
+static char** path_completion(const char *restrict text);
+static int dir_listing_key(const char *restrict dir, size_t len, char *restrict key);
+static dir_listing* dir_listing_request(const char *restrict key, index_cache_mtime mtime);
+static void dir_listing_prefetch(const char *restrict dir, size_t len);
+static void dir_listing_start();
+static void* dir_listing_worker(void*);
+static void dir_listing_load(dir_listing *restrict l, char *restrict buf, arena *restrict names);
+static int prompt_prefetch();
+static int typing_prefetch(FILE *stream);
 
 /*=================================================================================================
   GLOBALS
 =================================================================================================*/
 
 /* Mappings from enum to string / functions. */
-static const char *builtins[Builtins_Size] = {[CD]="cd", [PWD]="pwd", [Echo]="echo", [Type]="type", [Exit]="exit", [History]="history"};
+static const char *builtins[Builtins_Size] = {[CD]="cd", [PWD]="pwd", [Echo]="echo", [Type]="type", [Exit]="exit", [History]="history",
+  [Jobs]="jobs", [Wait]="wait", [FG]="fg", [BG]="bg", [Time]="time", [Hash]="hash",
+  [Export]="export", [Unset]="unset"};
 static void (*const builtin_functions[Builtins_Size])(const args *, arena *) = {
-  [CD]=builtin_cd, [PWD]=builtin_pwd, [Echo]=builtin_echo, [Type]=builtin_type, [Exit]=builtin_exit, [History]=builtin_history};
+  [CD]=builtin_cd, [PWD]=builtin_pwd, [Echo]=builtin_echo, [Type]=builtin_type, [Exit]=builtin_exit, [History]=builtin_history,
+  [Jobs]=builtin_jobs, [Wait]=builtin_wait, [FG]=builtin_fg, [BG]=builtin_bg, [Time]=builtin_time, [Hash]=builtin_hash,
+  [Export]=builtin_export, [Unset]=builtin_unset};
 /* Global sorted string list to interface with GNU Readline. */
 static permanent_strings strings;
 static pthread_once_t strings_once = PTHREAD_ONCE_INIT;
+static strings_trie trie;
+static strings_eytzinger eytzinger;
+static path_watch watch = {.fd = -1};
+static int index_timing = 0; // `LUSH_TIMING`: report scan / sort times of every index build.
 static int session_command_count = 0;
+static history_store history;
+static command_hash hashed;
+static var_table vars;
+/* Words grown by `$` expansion are built here instead of in place, see `tokenize`. */
+static arena expansions;
+static glob_state globber;
+/* Lines inside `$(...)` are tokenized and parsed here, and their output read in, see `lex_substitute`. */
+static arena substitutions;
+static arena *out_capture = NULL; // Set while a builtin runs for `$(...)`: `out_flush` appends there.
+static int last_status = 0; // `$?`: exit status of the last command or pipeline.
+static dir_listings listings = {.lock = PTHREAD_MUTEX_INITIALIZER, .queued = PTHREAD_COND_INITIALIZER,
+  .ready = PTHREAD_COND_INITIALIZER, .once = PTHREAD_ONCE_INIT};
+static trace_log trace = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+static _Thread_local pid_t trace_tid;
+/* Drives `tokenize`: every byte not listed is `Class_Word`. */
+static const uint8_t char_classes[EXTENDED_ASCII] = {
+  ['\0']=Class_End, [' ']=Class_Space, ['\t']=Class_Space, ['\n']=Class_Space,
+  ['|']=Class_Operator, ['&']=Class_Operator, ['>']=Class_Operator,
+  ['\'']=Class_Single_Quote, ['"']=Class_Double_Quote, ['\\']=Class_Backslash, ['$']=Class_Dollar, ['`']=Class_Dollar,
+  ['*']=Class_Glob, ['?']=Class_Glob, ['[']=Class_Glob};
+/* Builtins that change the shell itself. Inside pipelines they run in a child, like a subshell would. */
+static const int builtin_needs_child[Builtins_Size] = {[CD]=1, [Exit]=1, [Wait]=1, [FG]=1, [BG]=1, [Hash]=1, [Export]=1, [Unset]=1};
+static const char *spawn_backends[Spawn_Backend_Size] = {[Spawn_Posix]="posix_spawn", [Spawn_Vfork]="vfork", [Spawn_Fork]="fork"};
+static enum Spawn_Backend spawn_backend = Spawn_Posix;
+static int pipe_size = 0; // `LUSH_PIPE_SIZE`: capacity asked for every pipe, 0 for the kernel's default.
+extern char **environ;
+static job jobs[MAX_JOBS];
+/* Builtins print here instead of to stdout, see `out_flush`. */
+static arena out;
+static int interactive = 0; // Reading a terminal through Readline: job notices and terminal hand-over.
 
 /*=================================================================================================
   IMPLEMENTATIONS
@@ -213,6 +794,18 @@ static int session_command_count = 0;
 
 int main(int argc, char *argv[])
 {
+  // Before any thread reads a variable.
+  vars_init();
+  // Before any thread starts: the background index build is traced too.
+  const char *trace_path = var_get("LUSH_TRACE");
+  if (trace_path && *trace_path)
+    trace_start(trace_path);
+
+  // SIGCHLD is only handled on the main thread, which blocks it around job table changes.
+  sigset_t chld, old_mask;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &chld, &old_mask);
   pthread_t tid;
   if (pthread_create(&tid, NULL, init_once, NULL) != 0)
   {
@@ -220,493 +813,2876 @@ int main(int argc, char *argv[])
     pthread_once(&strings_once, build_autocomplete_strings);
   }
   pthread_detach(tid);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
   setbuf(stdout, NULL);
+  arena_init(&out, OUT_BUFFER_SIZE);
 
+  // Background jobs are reaped as they change state.
+  struct sigaction on_chld = {.sa_handler = sigchld_handler, .sa_flags = SA_RESTART};
+  sigemptyset(&on_chld.sa_mask);
+  sigaction(SIGCHLD, &on_chld, NULL);
+
+  // Launch strategy for external commands.
+  const char *backend = var_get("LUSH_SPAWN");
+  if (backend)
+  {
+    int i = 0;
+    while (i < Spawn_Backend_Size && strcmp(backend, spawn_backends[i]) != 0)
+      i++;
+    if (i < Spawn_Backend_Size)
+      spawn_backend = i;
+    else fprintf(stderr, "lush: LUSH_SPAWN: %s: unknown backend, using %s\n", backend, spawn_backends[spawn_backend]);
+  }
+  // Pipe capacity for bulk pipelines, in bytes or with a K / M suffix. The kernel rounds it up to pages.
+  const char *size = var_get("LUSH_PIPE_SIZE");
+  if (size && *size)
+  {
+    char *end;
+    unsigned long n = strtoul(size, &end, 10);
+    n <<= *end == 'K' || *end == 'k' ? 10 : *end == 'M' || *end == 'm' ? 20 : 0;
+    end += *end && strchr("KkMm", *end);
+    if (*end || n == 0 || n > INT_MAX)
+      fprintf(stderr, "lush: LUSH_PIPE_SIZE: %s: not a size, using the default\n", size);
+    else pipe_size = n;
+  }
+
+  // Reserved up front, committed as lines need it: long lines and pipelines just grow it.
   arena repl_arena;
-  arena_init(&repl_arena, ARENA_DEFAULT_SIZE);
+  arena_virtual_init(&repl_arena, REPL_ARENA_RESERVE);
+  // Expanded words get the top of the same reservation, out of the way of tokens and args,
+  // and command substitutions the part below them.
+  repl_arena.reserved -= EXPANSION_RESERVE + SUBSTITUTION_RESERVE;
+  substitutions = (arena){.data = repl_arena.data + repl_arena.reserved, .reserved = SUBSTITUTION_RESERVE};
+  expansions = (arena){.data = substitutions.data + SUBSTITUTION_RESERVE, .reserved = EXPANSION_RESERVE};
+  arena_commit(&substitutions, ARENA_DEFAULT_SIZE);
+  arena_commit(&expansions, ARENA_DEFAULT_SIZE);
+  // Scripts may still `history -r`.
+  arena_virtual_init(&history.text, HISTORY_TEXT_RESERVE);
 
   // GNU Readline interface.
   rl_attempted_completion_function = attempted_completion_function;
 
-  // history builtin.
+  // Script mode: `shell file.sh`, or commands piped into stdin. No readline, no history.
+  if (argc > 1)
+  {
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+      fprintf(stderr, "lush: %s: %s\n", argv[1], strerror(errno));
+      return 127;
+    }
+    run_script(fd, &repl_arena);
+    return last_status;
+  }
+  if (!isatty(STDIN_FILENO))
+  {
+    run_script(STDIN_FILENO, &repl_arena);
+    return last_status;
+  }
+
+  // history builtin. Only the newest lines are read before the first prompt.
   using_history();
-  read_history(getenv("HISTFILE"));
+  history_store_start(history_store_path());
+  rl_bind_keyseq("\\C-r", history_search_key);
+  // Argument completion reads directory listings loaded in the background.
+  rl_pre_input_hook = prompt_prefetch;
+  rl_getc_function = typing_prefetch;
+  // Completed names with these get single quoted, which `tokenize` undoes.
+  rl_completer_quote_characters = "'\"";
+  rl_filename_quote_characters = " \t\n\\\"'|&>";
 
   // REPL
+  interactive = 1;
   char *input;
-  while ((input = readline("$ ")))
+  while (jobs_notify(), (input = readline("$ ")))
   {
-    if (*skip_spaces(input) == '\0')
-      continue;
-    add_history(input);
-    session_command_count++;
-    arena_reset(&repl_arena);
-    ssize_t line_len = strlen(input) + 1;
-
-    // TODO: reuse `readline`'s buffer instead of copying it to arena.
-    char *line_buffer = arena_push(&repl_arena, alignof(char), line_len + 1); // Double NUL terminator simplifies tokenizing.
-    memcpy(line_buffer, input, line_len);
-    *(line_buffer + line_len) = '\0';
-    free(input);
-
-    // Read:
-    const tokens *tks = tokenize(&repl_arena);
-    const commands *cmds = parse(tks, &repl_arena);
-    const args *a = cmds->v;
-
-    // Eval-Print:
-    int i = 0;
-    while (i < cmds->c)
+    if (*skip_spaces(input) != '\0')
     {
-      int pipeline_length = 0;
-      {
-        const args *temp = a;
-        while (temp->redirection.t == Pipe)
-        {
-          temp = ADVANCE_ARGS(temp);
-          pipeline_length++;
-        }
-      }
-      if (pipeline_length == 0)
-        a = execute_single_command(a, &repl_arena);
-      else
+      // HISTCONTROL may leave it out.
+      if (history_store_add(input))
       {
-        // TODO (long term): figure out how pipes and redirection should interact and implement that.
-        int (*pipes)[2] = arena_push(&repl_arena, alignof(int[2]), pipeline_length * sizeof(int[2]));
-        for (int i = 0; i < pipeline_length; i++)
-          pipe(pipes[i]);
-        pid_t *children = arena_push(&repl_arena, alignof(pid_t), (pipeline_length + 1) * sizeof(pid_t));
-        for (int i = 0; i <= pipeline_length; i++, a = ADVANCE_ARGS(a))
-        {
-          pid_t pid = fork();
-          assert((pid != -1) && "`fork` failed in pipeline.");
-          // Child process
-          if (pid == 0)
-          {
-            // Redirect stdin for all but the first.
-            if (i > 0)
-              dup2(pipes[i-1][0], STDIN_FILENO);
-            // Redirect stdout for all but the last.
-            // TODO: check `a->redirection.t` for file redirections?
-            if (i < pipeline_length)
-              dup2(pipes[i][1], STDOUT_FILENO);
-
-            // Close duplicated pipes.
-            for (int i = 0; i < pipeline_length; i++)
-            {
-              close(pipes[i][0]);
-              close(pipes[i][1]);
-            }
-
-            // Builtin
-            for (int i = 0; i < Builtins_Size; i++) if (strcmp(a->v[0], builtins[i]) == 0)
-            {
-              builtin_functions[i](a, &repl_arena);
-              exit(0);
-            }
-
-            // Executable
-
-            const char *full_path = find_executable(a->v[0]);
-            if (full_path)
-            {
-              execv(full_path, a->v);
-              exit(EXIT_FAILURE);
-            }
-            else fprintf(stderr, "%s: command not found\n", a->v[0]);
-            exit(127); // Command not found exit code.
-          }
-          // Parent
-          children[i] = pid;
-        }
-        // Close all pipes on parent
-        for (int i = 0; i < pipeline_length; i++)
-        {
-          close(pipes[i][0]);
-          close(pipes[i][1]);
-        }
-        for (int i = 0; i <= pipeline_length; i++)
-        {
-          int wstat;
-          pid_t w = waitpid(children[i], &wstat, 0);
-          assert((w != 1) && "`waitpid` failed in pipeline");
-        }
+        add_history(input);
+        session_command_count++;
       }
-      i += pipeline_length + 1;
+      // Tokenized in place: `readline`'s buffer is the line buffer.
+      execute_line(input, &repl_arena);
     }
+    free(input);
   }
 
   return 0;
 }
 
-static const args* execute_single_command(const args *restrict a, arena *restrict allocator)
+// Tokenizes, parses and runs one NUL terminated line. `line` is overwritten by the tokenizer.
+static void execute_line(char *restrict line, arena *restrict repl_arena)
+{
+  arena_reset(repl_arena);
+  arena_reset(&expansions);
+  arena_reset(&substitutions);
+  // Give an unusually large command's pages back, so RSS stays flat.
+  arena_trim(repl_arena, ARENA_DEFAULT_SIZE);
+  arena_trim(&expansions, ARENA_DEFAULT_SIZE);
+  arena_trim(&substitutions, ARENA_DEFAULT_SIZE);
+
+  // Read:
+  uint64_t line_start = trace_begin();
+  const tokens *tks = tokenize(line, repl_arena);
+  trace_end("tokenize", line_start, NULL);
+  uint64_t parse_start = trace_begin();
+  const commands *cmds = parse(tks, repl_arena);
+  trace_end("parse", parse_start, NULL);
+  execute_commands(cmds, repl_arena);
+  trace_end("line", line_start, cmds->c ? cmds->v[0].v[0] : NULL);
+}
+
+// Eval-Print: runs `cmds` list by list. A list ends at `&` or at the end of the line.
+static void execute_commands(const commands *restrict cmds, arena *restrict allocator)
 {
-  // Redirect.
-  int saved_fd, target_fd;
-  FILE *fp;
-  if (a->redirection.t != Word)
+  const args *a = cmds->v;
+  int i = 0;
+  while (i < cmds->c)
   {
-    char *modes;
-    switch (EXTRACT_TOKEN_TYPE(a->redirection)) {
-      case RedirectOut:
-        target_fd = STDOUT_FILENO;
-        modes = "w";
-        break;
-      case RedirectErr:
-        target_fd = STDERR_FILENO;
-        modes = "w";
-        break;
-      case AppendOut:
-        target_fd = STDOUT_FILENO;
-        modes = "a";
-        break;
-      case AppendErr:
-        target_fd = STDERR_FILENO;
-        modes = "a";
-        break;
-      default:
-        assert(0 && "Unreachable: invalid redirection.");
-        break;
+    int count = 1, sequential = 0;
+    const args *last = a;
+    while (last->link != Background && i + count < cmds->c)
+    {
+      sequential |= last->link == Sequential;
+      last = ADVANCE_ARGS(last);
+      count++;
     }
-    saved_fd = dup(target_fd);
-    assert((saved_fd != -1) && "Failed `dup` for redirection.");
-    intptr_t ptr = a->redirection.ptr >> TOKEN_SHIFT;
-    char *dst = (char*)ptr;
-    enum Token_Type t = a->redirection.t & TOKEN_TYPE_MASK;
-    fp = fopen(EXTRACT_TOKEN_PTR(a->redirection), modes);
-    assert(fp && "Failed opening file for redirection.");
-    int fd = fileno(fp);
-    assert((fd != -1) && "Failed `fileno`.");
-    int err = dup2(fd, target_fd);
-    assert((err != -1) && "Failed `dup2` for starting redirection.");
+    // `a && b &` backgrounds the whole list. A lone pipeline is a job by itself.
+    if (last->link == Background && sequential)
+      a = execute_list_background(a, count, allocator);
+    else a = execute_list(a, count, 0, allocator);
+    i += count;
   }
+}
 
-  // Builtins:
-  int is_builtin = 0;
-  for (int i = 0; i < Builtins_Size; i++) if (strcmp(a->v[0], builtins[i]) == 0)
-  {
-    builtin_functions[i](a, allocator);
-    is_builtin = 1;
-    break;
-  }
-  if (!is_builtin) // executable
+/* Runs the `count` commands starting at `a` pipeline by pipeline. Inside a job
+ * (`in_job`) its trailing `&` is already taken care of, so the last pipeline
+ * runs in the foreground of the job's process. */
+static const args* execute_list(const args *restrict a, int count, int in_job, arena *restrict allocator)
+{
+  int i = 0;
+  while (i < count)
   {
-    const char *full_path = find_executable(a->v[0]);
-    if (full_path)
+    int pipeline_length = 0;
+    const args *last = a;
+    while (last->link == Pipe)
     {
-      pid_t pid = fork();
-      assert((pid != -1) && "`fork` failed.");
-      // Child process
-      if (pid == 0)
-      {
-        execv(full_path, a->v);
-        exit(EXIT_FAILURE);
-      }
-      // Original process
-      else
-      {
-        int wstat;
-        pid_t w = waitpid(pid, &wstat, 0);
-        assert((w != -1) && "`waitpid` failed.");
-      }
+      last = ADVANCE_ARGS(last);
+      pipeline_length++;
     }
-    else fprintf(stderr, "%s: command not found\n", a->v[0]);
-  }
-  // Restore redirection.
-  if (a->redirection.t != Word)
-  {
-    dup2(saved_fd, target_fd);
-    close(saved_fd);
-    fclose(fp);
+    if (last->link == Background && !in_job)
+      a = execute_pipeline(a, pipeline_length, 1, allocator);
+    else if (pipeline_length == 0)
+      a = execute_single_command(a, allocator);
+    else a = execute_pipeline(a, pipeline_length, 0, allocator);
+    i += pipeline_length + 1;
   }
-  return ADVANCE_ARGS(a);
+  return a;
 }
 
-static void builtin_cd(const args *restrict a, arena *restrict allocator)
+/* Runs the `count` commands starting at `a`, a list ended by `&`, as one job:
+ * a forked copy of the shell leads a new process group and runs the list in it. */
+static const args* execute_list_background(const args *restrict a, int count, arena *restrict allocator)
 {
-  if ((a->c == 1) || (a->c == 2 && (strcmp(a->v[1], "~")) == 0))
+  const args *next = a;
+  for (int i = 0; i < count; i++)
+    next = ADVANCE_ARGS(next);
+  int slot = job_slot();
+  if (slot == -1)
   {
-    char *home = getenv("HOME");
-    assert(home && "HOME environment variable not found.");
-    if (chdir(home))
-      fprintf(stderr, "cd: %s: No such file or directory\n", a->v[1]);
+    fprintf(stderr, "lush: too many jobs\n");
+    last_status = 1;
+    return next;
   }
-  else if (a->c == 2 && chdir(a->v[1]))
-    fprintf(stderr, "cd: %s: No such file or directory\n", a->v[1]);
-  else if (a->c >= 3)
-  perror("lush: cd: too many arguments\n");
+  uint64_t fork_start = trace_begin();
+  pid_t pid = fork();
+  assert((pid != -1) && "`fork` failed for a background list.");
+  if (pid == 0)
+  {
+    setpgid(0, 0);
+    // The copied job table is the shell's: this process neither reports nor reaps those.
+    interactive = 0;
+    // An `exit` in here must not append this session's history a second time.
+    session_command_count = 0;
+    execute_list(a, count, 1, allocator);
+    _exit(last_status);
+  }
+  // Also set from this side, so the group exists whichever process runs first.
+  setpgid(pid, pid);
+  trace_end("fork", fork_start, a->v[0]);
+  job_add(slot, a, count, pid, &pid, 1);
+  last_status = 0;
+  return next;
 }
 
-static void builtin_pwd(const args *restrict a, arena *restrict allocator)
+/* Runs every line of `fd`. Regular files are mapped privately and tokenized right
+ * in the mapping; pipes are read in `SCRIPT_READ_SIZE` blocks and tokenized in
+ * the read buffer. Either way lines are never copied. */
+static void run_script(int fd, arena *restrict repl_arena)
 {
-  char *cwd = arena_push(allocator, alignof(char), MAX_CWD_SIZE);
-  char *ptr = getcwd(cwd, MAX_CWD_SIZE);
-  assert(ptr && "`getcwd` failed.");
-  printf("%s\n", cwd);
-}
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+  {
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    size_t len = st.st_size - (start > 0 ? start : 0);
+    if (!len)
+      return;
+    // Private and writable: the tokenizer's NULs only touch copy-on-write pages.
+    // Mapped from offset 0, since mappings must start on a page boundary.
+    size_t offset = st.st_size - len;
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED)
+    {
+      char *buf = map + offset;
+      size_t done = run_script_lines(buf, len, repl_arena);
+      if (done < len)
+      {
+        // Unterminated last line. The page tail past EOF is zeroed, unless the file fills its last page.
+        long page = sysconf(_SC_PAGESIZE);
+        if (st.st_size % page)
+          run_script_line(buf + done, repl_arena);
+        else
+        {
+          arena line;
+          arena_init(&line, len - done + 1);
+          char *copy = arena_push(&line, alignof(char), len - done + 1);
+          memcpy(copy, buf + done, len - done);
+          copy[len - done] = '\0';
+          run_script_line(copy, repl_arena);
+          arena_destroy(&line);
+        }
+      }
+      munmap(map, st.st_size);
+      return;
+    }
+  }
 
-static void builtin_echo(const args *restrict a, arena *restrict allocator)
-{
-  size_t end = a->c - 1;
-  if (end)
+  arena input;
+  arena_virtual_init(&input, REPL_ARENA_RESERVE);
+  size_t len = 0;
+  for (;;)
   {
-    for (size_t i = 1; i < end; ++i)
-      printf("%s ", a->v[i]);
-    printf("%s\n", a->v[end]);
+    // Room for a full read plus the NUL of an unterminated last line.
+    if (input.capacity < len + SCRIPT_READ_SIZE + 1)
+      arena_commit(&input, len + SCRIPT_READ_SIZE + 1);
+    ssize_t n = read(fd, input.data + len, SCRIPT_READ_SIZE);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    len += n;
+    size_t done = run_script_lines(input.data, len, repl_arena);
+    // Keep the partial last line for the next read.
+    memmove(input.data, input.data + done, len - done);
+    len -= done;
   }
+  input.data[len] = '\0';
+  run_script_line(input.data, repl_arena);
+  arena_destroy(&input);
 }
 
-static void builtin_type(const args *restrict a, arena *restrict allocator)
+// Runs the complete lines of `buf`, skipping blanks and `#` comments. Returns the bytes consumed.
+static size_t run_script_lines(char *restrict buf, size_t len, arena *restrict repl_arena)
 {
-  for (int i = 1; i < a->c; i++)
+  char *p = buf, *end = buf + len, *nl;
+  while ((nl = memchr(p, '\n', end - p)))
   {
-    char *arg = a->v[i];
-    const char *full_path = find_executable(arg);
-    if (full_path)
-      printf("%s is %s\n", arg, full_path);
-    // Default case:
-    else fprintf(stderr, "%s: not found\n", arg);
+    *nl = '\0';
+    run_script_line(p, repl_arena);
+    p = nl + 1;
   }
+  return p - buf;
 }
 
-static void builtin_exit(const args *restrict a, arena *restrict allocator)
+// Runs one NUL-terminated script line unless it is blank or a `#` comment.
+static void run_script_line(char *restrict line, arena *restrict repl_arena)
 {
-  if (a->c > 2)
-    perror("lush: exit: too many arguments\n");
-  else
-  {
-    append_history(session_command_count, getenv("HISTFILE"));
-    if (a->c == 1)
-      exit(0);
-    else if (!is_decimal_num(a->v[1]))
-      exit(2);
-    else
-      exit((unsigned char) atoll(a->v[1]));
-  }
+  char *first = skip_spaces(line);
+  if (*first != '\0' && *first != '#')
+    execute_line(line, repl_arena);
 }
 
-static void builtin_history(const args *restrict a, arena *restrict allocator)
+static const args* execute_single_command(const args *restrict a, arena *restrict allocator)
 {
-  if (a->c > 3)
-    perror("lush: history: too many arguments\n");
-  // Print history.
-  else if (a->c < 3)
+  if (var_assignments(a))
+    return ADVANCE_ARGS(a);
+  // A command that never runs is still reported by `time`, as a row of dashes.
+  stage_time t = {.name = a->v[0], .start = now_ns()};
+  // Builtins:
+  int i = find_builtin(a->v[0]);
+  if (i != -1)
   {
-    HIST_ENTRY **the_list = history_list();
-    int limit = 0;
-    if (a->c == 2)
+    // Redirect the shell itself around the builtin.
+    int saved_fd = -1, target_fd = -1;
+    if (a->redirection.t == Word || (saved_fd = redirect_shell(a->redirection, &target_fd)) != -1)
     {
-      if (!is_decimal_num(a->v[1]))
-      {
-        fprintf(stderr, "lush: history: %s: numeric argument required\n", a->v[1]);
-        return;
-      }
-      limit = atoi(a->v[1]);
-      if (limit < 0)
-      {
-        fprintf(stderr, "lush: history: %s: invalid option", a->v[1]);
-        return;
-      }
-      limit = history_length - limit;
+      if (a->timed)
+        stage_time_self(&t, 0);
+      run_builtin(i, a, allocator);
+      if (a->redirection.t != Word)
+        redirect_restore(saved_fd, target_fd);
+      if (a->timed)
+        stage_time_self(&t, 1);
     }
+    if (a->timed)
+      time_report(&t, 1, t.start);
+    return ADVANCE_ARGS(a);
+  }
 
-    for (int i = limit; the_list[i]; i++)
-      printf("%5d  %s\n", i+1, the_list[i]->line);
+  // Executable
+  const char *full_path = find_executable(a->v[0]);
+  if (full_path)
+  {
+    spawn_fds fds = {.in = -1, .out = -1, .redirection = a->redirection};
+    pid_t pid = spawn_command(full_path, a->v, &fds);
+    last_status = fds.status;
+    if (pid != -1)
+    {
+      int wstat;
+      uint64_t wait_start = trace_begin();
+      pid_t w = wait4(pid, &wstat, 0, &t.usage);
+      assert((w != -1) && "`waitpid` failed.");
+      trace_end("wait", wait_start, a->v[0]);
+      last_status = wait_status(wstat);
+      t.end = now_ns();
+    }
   }
-  // (a->c == 3)
-  // Read / write / append file.
-  else if (strcmp(a->v[1], "-r") == 0)
-    read_history(a->v[2]);
-  else if (strcmp(a->v[1], "-w") == 0)
-    write_history(a->v[2]);
-  else if (strcmp(a->v[1], "-a") == 0)
+  else
   {
-    append_history(session_command_count, a->v[2]);
-    session_command_count = 0;
+    fprintf(stderr, "%s: command not found\n", a->v[0]);
+    last_status = 127;
   }
-  else fprintf(stderr, "lush: history: %s: invalid option", a->v[1]);
-}
-
-static const char* find_executable(const char *restrict target)
-{
-  int32_t offset = strings_binary_search(target);
-  if (offset == -1)
-    return NULL;
-  char *candidate = strings.strings + strings.offsets[offset];
-  return strcmp(target, candidate) == 0 ?
-    strings.strings + strings.offsets[strings.count + offset] :
-    NULL;
+  if (a->timed)
+    time_report(&t, 1, t.start);
+  return ADVANCE_ARGS(a);
 }
 
-static const tokens* tokenize(arena *restrict allocator)
+/* Runs `pipeline_length + 1` commands joined by pipes. External stages are spawned
+ * first, so every reader exists before the builtin stages then run in this process
+ * with stdout pointed at their pipe. Only `builtin_needs_child` builtins fork.
+ * Pipes are made one stage ahead and close-on-exec: a child only dups its own two
+ * ends, and the parent drops each end once the stage that needs it is started, so
+ * setup is O(n). A redirection on a stage wins over its pipe, as in other shells. */
+static const args* execute_pipeline(const args *restrict a, int pipeline_length, int background, arena *restrict allocator)
 {
-  char *p = allocator->data; // User input lies at the start of the arena.
+  // A background job needs a slot before anything is started.
+  int slot = -1;
+  if (background && (slot = job_slot()) == -1)
+  {
+    fprintf(stderr, "lush: too many jobs\n");
+    for (int i = 0; i <= pipeline_length; i++)
+      a = ADVANCE_ARGS(a);
+    return a;
+  }
+  const args *first = a;
+  pid_t pgid = 0; // Group of a background job: its first process.
 
-  // Push a slice to the arena. Fill `tokens->v` by pushing tokens on the arena.
-  tokens *tks = ALLOCATOR_PUSH_TYPE(tokens);
+  pid_t *children = arena_push(allocator, alignof(pid_t), (pipeline_length + 1) * sizeof(pid_t));
+  const args **in_process = arena_push(allocator, alignof(args*), (pipeline_length + 1) * sizeof(args*));
+  // Write ends kept open for in-process builtins until they run, in stage order. Forked builtins close them.
+  int *held = arena_push(allocator, alignof(int), (pipeline_length + 1) * sizeof(int));
+  int held_count = 0;
+  // `time` is not reported for background jobs.
+  int timed = first->timed && !background;
+  stage_time *times = timed ? arena_push(allocator, alignof(stage_time), (pipeline_length + 1) * sizeof(stage_time)) : NULL;
+  uint64_t pipeline_start = now_ns();
 
-  size_t count = 0; // Keep count of tokens for `tokens->c`.
-  while (*p)
+  int in = -1; // Read end of the pipe into the current stage.
+  int last_failed = 127; // Status of the last stage if it never starts.
+  int i = 0;
+  for (; i <= pipeline_length; i++, a = ADVANCE_ARGS(a))
   {
-    p = skip_spaces(p);
-    char c = *p;
-    // Finished parsing
-    if (!c)
-      break;
-    // Multiple commands case
-    if (c == '|')
+    int pipe_fds[2] = {-1, -1};
+    if (i < pipeline_length && pipe_open(pipe_fds) == -1)
     {
-        ALLOCATOR_PUSH_TYPE(token)->t = Pipe;
-        p++;
+      fprintf(stderr, "lush: pipe: %s\n", strerror(errno));
+      break;
     }
-    else if (c == '&')
+    children[i] = -1;
+    in_process[i] = NULL;
+    if (timed)
+      times[i] = (stage_time){.name = a->v[0], .start = now_ns()};
+    int builtin = find_builtin(a->v[0]);
+    // A background job never blocks the shell: its builtins fork too.
+    if (builtin != -1 && !builtin_needs_child[builtin] && !background)
     {
-      // Sequential
-      if (*(p+1) == '&')
-      {
-        ALLOCATOR_PUSH_TYPE(token)->t = Sequential;
-        p += 2;
-      }
-      else
-      {
-        ALLOCATOR_PUSH_TYPE(token)->t = Background;
-        p++;
-      }
+      in_process[i] = a;
+      if (pipe_fds[1] != -1)
+        held[held_count++] = pipe_fds[1];
     }
-    // Redirect stdout case
-    else if ((c == '>') || ((c == '1') && (*(p+1) == '>') && p++))
+    else
     {
-      // Append case
-      if (*(p+1) == '>')
+      // Stdin from the previous stage, stdout to the next one.
+      spawn_fds fds = {
+        .in = in,
+        .out = pipe_fds[1],
+        .redirection = a->redirection,
+        .pgid = background ? (pgid ? pgid : -1) : 0,
+      };
+      if (builtin != -1 && spawn_redirect_open(&fds) == -1)
+        fds.status = 1;
+      else if (builtin != -1)
       {
-        ALLOCATOR_PUSH_TYPE(token)->t = AppendOut;
-        p += 2;
+        // A forked builtin never execs, so close-on-exec would not drop these.
+        fds.close = held;
+        fds.close_count = held_count;
+        uint64_t fork_start = trace_begin();
+        pid_t pid = fork();
+        assert((pid != -1) && "`fork` failed in pipeline.");
+        // Child process
+        if (pid == 0)
+        {
+          if (spawn_child_setup(&fds) != 0)
+          {
+            fprintf(stderr, "lush: %s: %s\n", a->v[0], strerror(errno));
+            exit(EXIT_FAILURE);
+          }
+          run_builtin(builtin, a, allocator);
+          exit(last_status);
+        }
+        // Parent
+        children[i] = pid;
+        if (fds.redirection.t != Word)
+          close(fds.redirect_fd);
+        trace_end("fork", fork_start, a->v[0]);
       }
       else
       {
-        ALLOCATOR_PUSH_TYPE(token)->t = RedirectOut;
-        p++;
-      }
-    }
-    // Redirect stderr case
-    else if ((c == '2') && (*(p+1) == '>'))
-    {
-      // Append case
-      if (*(p+2) == '>')
-      {
-        ALLOCATOR_PUSH_TYPE(token)->t = AppendErr;
-        p += 3;
+        // Executable
+        const char *full_path = find_executable(a->v[0]);
+        if (full_path)
+          children[i] = spawn_command(full_path, a->v, &fds);
+        else fprintf(stderr, "%s: command not found\n", a->v[0]);
       }
-      else
+      if (i == pipeline_length && fds.status)
+        last_failed = fds.status;
+      if (pipe_fds[1] != -1)
+        close(pipe_fds[1]);
+      // Also set from this side, so the group exists whichever process runs first.
+      if (background && children[i] != -1)
       {
-        ALLOCATOR_PUSH_TYPE(token)->t = RedirectErr;
-        p += 2;
+        setpgid(children[i], pgid ? pgid : children[i]);
+        if (!pgid)
+          pgid = children[i];
       }
     }
-    // Word case
-    else
+    // Builtins never read stdin: closing their read end turns upstream writes into EPIPE.
+    if (in != -1)
+      close(in);
+    in = pipe_fds[0];
+  }
+  // A failed `pipe2` leaves the rest of the pipeline unstarted.
+  int broken = i <= pipeline_length;
+  if (broken)
+  {
+    if (in != -1)
+      close(in);
+    for (; i <= pipeline_length; i++, a = ADVANCE_ARGS(a))
     {
-      char *start = p;
-      int should_overwrite = 0;
+      children[i] = -1;
+      in_process[i] = NULL;
+      if (timed)
+        times[i] = (stage_time){.name = a->v[0], .start = now_ns(), .end = now_ns()};
+    }
+  }
 
-      for (;;)
+  if (background)
+  {
+    if (pgid)
+      job_add(slot, first, pipeline_length + 1, pgid, children, pipeline_length + 1);
+    last_status = broken;
+    return a;
+  }
+
+  // In-process builtins, in pipeline order. SIGPIPE would kill the shell itself.
+  struct sigaction ignore = {.sa_handler = SIG_IGN}, old_sigpipe;
+  sigaction(SIGPIPE, &ignore, &old_sigpipe);
+  for (int i = 0, h = 0; i <= pipeline_length; i++) if (in_process[i])
+  {
+    const args *b = in_process[i];
+    int saved_fd = -1;
+    // Every stage but the last holds a write end.
+    if (i < pipeline_length)
+    {
+      int out_fd = held[h++];
+      saved_fd = dup(STDOUT_FILENO);
+      if (saved_fd == -1 || dup2(out_fd, STDOUT_FILENO) == -1)
       {
-        char c = *p++;
-        // Ignore everything inside single quotes.
-        if (c == '\'')
-        {
-          should_overwrite = 1;
-          do assert(*p && "unterminated single quotes");
-          while (*p++ != '\'');
-        }
-        // Ignore _almost_ everything inside double quotes.
-        else if (c == '"')
-        {
-          should_overwrite = 1;
-          while (*p != '"')
-          {
-            assert(c && "unterminated double quotes");
-            char c = *p++;
-            if (c == '\\')
-            {
-              p++;
-              assert(*p && "unterminated double quotes");
-            }
-          }
-          p++;
-        }
-        // Escape any character.
-        else if (c == '\\')
-        {
-          should_overwrite = 1;
-          assert(*p && "escaped NUL terminator");
-          p++;
-        }
-        // Base cases: exit when this token is over.
-        else if (!c || is_whitespace(c))
-          break;
-        // Edge case:
-        else if (c == '>' || c == '|' || c == '&')
-        {
-          assert(0 && "Include whitespaces. Parsing not supported.");
-          // These tokens no whitespace require parsing the entire token (> or >>) prior to adding the null terminator, which overwrite the first character.
-          // Edge case: what happens when a word is next to `>`? We need to null terminate the word to point into it, but we can't simply overwrite `>` and skip it. Lookahead.
-          // TODO: implement this.
-          break;
-        }
-        // Default: get next character.
+        fprintf(stderr, "lush: %s: %s\n", b->v[0], strerror(errno));
+        close(out_fd);
+        if (saved_fd != -1)
+          close(saved_fd);
+        last_status = 1;
+        continue;
       }
+      close(out_fd);
+    }
+    int target_fd, redirect_fd = 0;
+    if (b->redirection.t != Word)
+      redirect_fd = redirect_shell(b->redirection, &target_fd);
+    if (redirect_fd != -1)
+    {
+      if (timed)
+        stage_time_self(&times[i], 0);
+      run_builtin(find_builtin(b->v[0]), b, allocator);
+      if (timed)
+        stage_time_self(&times[i], 1);
+    }
+    if (b->redirection.t != Word && redirect_fd != -1)
+      redirect_restore(redirect_fd, target_fd);
+    // Restoring stdout drops the last write end: the next stage sees EOF.
+    if (saved_fd != -1)
+    {
+      dup2(saved_fd, STDOUT_FILENO);
+      close(saved_fd);
+    }
+  }
+  sigaction(SIGPIPE, &old_sigpipe, NULL);
 
-      // Add token to list.
-      if (!should_overwrite)
-        *(p - 1) = '\0';
+  // The last stage's status is the pipeline's, as set by its builtin or reaped below.
+  int status = in_process[pipeline_length] ? last_status : last_failed;
+  uint64_t wait_start = trace_begin();
+  if (timed)
+  {
+    int wstat = stages_reap(children, times, pipeline_length + 1, allocator);
+    if (children[pipeline_length] != -1)
+      status = wait_status(wstat);
+    time_report(times, pipeline_length + 1, pipeline_start);
+  }
+  else for (int i = 0; i <= pipeline_length; i++) if (children[i] != -1)
+  {
+    int wstat;
+    pid_t w = waitpid(children[i], &wstat, 0);
+    assert((w != -1) && "`waitpid` failed in pipeline");
+    if (i == pipeline_length)
+      status = wait_status(wstat);
+  }
+  trace_end("wait", wait_start, first->v[0]);
+  last_status = broken ? 1 : status;
+  return a;
+}
+
+// Index into `builtins`, or -1.
+static int find_builtin(const char *restrict name)
+{
+  for (int i = 0; i < Builtins_Size; i++)
+    if (strcmp(name, builtins[i]) == 0)
+      return i;
+  return -1;
+}
+
+// Runs a builtin and writes out what it printed, while its redirection is still in place.
+static void run_builtin(int builtin, const args *restrict a, arena *restrict allocator)
+{
+  uint64_t start = trace_begin();
+  last_status = 0;
+  builtin_functions[builtin](a, allocator);
+  out_flush();
+  trace_end("builtin", start, a->v[0]);
+}
+
+// Appends to `out`. Flushes first when it would not fit; larger writes skip the buffer.
+static void out_write(const char *restrict s, size_t n)
+{
+  if (out.len + n > out.capacity)
+  {
+    out_flush();
+    if (n > out.capacity)
+    {
+      out_send(s, n);
+      return;
+    }
+  }
+  memcpy(out.data + out.len, s, n);
+  out.len += n;
+}
+
+static void out_printf(const char *restrict format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  int n = vsnprintf(out.data + out.len, out.capacity - out.len, format, ap);
+  va_end(ap);
+  if (n < 0 || out.len + n < out.capacity)
+  {
+    out.len += n < 0 ? 0 : n;
+    return;
+  }
+  // Did not fit: retry in an empty buffer, or format a one-off copy.
+  out_flush();
+  va_start(ap, format);
+  if ((size_t)n < out.capacity)
+    out.len = vsnprintf(out.data, out.capacity, format, ap);
+  else
+  {
+    char *big = malloc(n + 1);
+    assert(big && "Out of memory for builtin output.");
+    vsnprintf(big, n + 1, format, ap);
+    out_write(big, n);
+    free(big);
+  }
+  va_end(ap);
+}
+
+// Writes `out` to stdout, whatever it points at now: a terminal, a redirected file or a pipe.
+static void out_flush()
+{
+  out_send(out.data, out.len);
+  out.len = 0;
+}
+
+// Where builtin output ends up: `out_capture` inside `$(...)`, stdout otherwise.
+static void out_send(const char *restrict s, size_t n)
+{
+  if (out_capture)
+    memcpy(arena_push(out_capture, alignof(char), n), s, n);
+  else write_all(STDOUT_FILENO, s, n);
+}
+
+// `write` until done. A closed reader (EPIPE) or any other error drops the rest.
+// Returns whether everything was written.
+static int write_all(int fd, const char *restrict s, size_t n)
+{
+  while (n)
+  {
+    ssize_t w = write(fd, s, n);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return 0;
+    s += w;
+    n -= w;
+  }
+  return 1;
+}
+
+// Points the shell's own stdout or stderr at `redirection` around an in-process builtin.
+// Returns a copy of the fd it replaced, for `redirect_restore`, or -1 after reporting a failure.
+static int redirect_shell(token redirection, int *restrict target_fd)
+{
+  int flags;
+  *target_fd = redirection_target(redirection, &flags);
+  int fd = open(EXTRACT_TOKEN_PTR(redirection), flags | O_CLOEXEC, 0666);
+  int saved_fd = fd == -1 ? -1 : fcntl(*target_fd, F_DUPFD_CLOEXEC, 0);
+  if (saved_fd == -1 || dup2(fd, *target_fd) == -1)
+  {
+    fprintf(stderr, "lush: %s: %s\n", EXTRACT_TOKEN_PTR(redirection), strerror(errno));
+    if (fd != -1)
+      close(fd);
+    if (saved_fd != -1)
+      close(saved_fd);
+    last_status = 1;
+    return -1;
+  }
+  close(fd);
+  return saved_fd;
+}
+
+static void redirect_restore(int saved_fd, int target_fd)
+{
+  dup2(saved_fd, target_fd);
+  close(saved_fd);
+}
+
+// `pipe2` with close-on-exec ends, grown to `LUSH_PIPE_SIZE` bytes when that is set.
+static int pipe_open(int fds[2])
+{
+  if (pipe2(fds, O_CLOEXEC) == -1)
+    return -1;
+  if (pipe_size && fcntl(fds[1], F_SETPIPE_SZ, pipe_size) == -1)
+  {
+    // Over /proc/sys/fs/pipe-max-size without CAP_SYS_RESOURCE, most likely. Said once.
+    fprintf(stderr, "lush: LUSH_PIPE_SIZE: %s, keeping the default size\n", strerror(errno));
+    pipe_size = 0;
+  }
+  return 0;
+}
+
+// Returns the fd a redirection token replaces and fills `open` flags for its target.
+static int redirection_target(token redirection, int *restrict flags)
+{
+  switch (EXTRACT_TOKEN_TYPE(redirection)) {
+    case RedirectOut:
+      *flags = O_WRONLY | O_CREAT | O_TRUNC;
+      return STDOUT_FILENO;
+    case RedirectErr:
+      *flags = O_WRONLY | O_CREAT | O_TRUNC;
+      return STDERR_FILENO;
+    case AppendOut:
+      *flags = O_WRONLY | O_CREAT | O_APPEND;
+      return STDOUT_FILENO;
+    case AppendErr:
+      *flags = O_WRONLY | O_CREAT | O_APPEND;
+      return STDERR_FILENO;
+    default:
+      assert(0 && "Unreachable: invalid redirection.");
+      return -1;
+  }
+}
+
+// `$?` of a child's wait status: its exit code, or 128 + the signal that ended it.
+static int wait_status(int wstat)
+{
+  return WIFEXITED(wstat) ? WEXITSTATUS(wstat) : WIFSIGNALED(wstat) ? 128 + WTERMSIG(wstat) : 128 + WSTOPSIG(wstat);
+}
+
+// Times an in-process builtin: call with `done` 0 before it runs and 1 after.
+static void stage_time_self(stage_time *restrict t, int done)
+{
+  struct rusage now;
+  getrusage(RUSAGE_THREAD, &now);
+  if (!done)
+  {
+    t->start = now_ns();
+    t->usage = now;
+    return;
+  }
+  t->end = now_ns();
+  timersub(&now.ru_utime, &t->usage.ru_utime, &t->usage.ru_utime);
+  timersub(&now.ru_stime, &t->usage.ru_stime, &t->usage.ru_stime);
+  t->usage.ru_maxrss = now.ru_maxrss;
+  t->usage.ru_nvcsw = now.ru_nvcsw - t->usage.ru_nvcsw;
+  t->usage.ru_nivcsw = now.ru_nivcsw - t->usage.ru_nivcsw;
+}
+
+/* Reaps `pids` (-1 entries skipped) with `wait4` in the order they exit, so each
+ * stage's wall time ends at its own exit. Waits on pidfds, then in order for the stages
+ * without one (old kernel, or out of descriptors).
+ * Returns the wait status of the last stage. */
+static int stages_reap(const pid_t *restrict pids, stage_time *restrict times, int count, arena *restrict allocator)
+{
+  int last = 0;
+  struct pollfd *fds = arena_push(allocator, alignof(struct pollfd), count * sizeof(struct pollfd));
+  int pending = 0;
+  for (int i = 0; i < count; i++)
+  {
+    fds[i] = (struct pollfd){.fd = -1, .events = POLLIN};
+    if (pids[i] != -1)
+    {
+      fds[i].fd = syscall(SYS_pidfd_open, pids[i], 0);
+      pending += fds[i].fd != -1;
+    }
+  }
+  while (pending)
+  {
+    int ready = poll(fds, count, -1);
+    if (ready == -1 && errno != EINTR)
+      break;
+    for (int i = 0; i < count; i++) if (fds[i].fd != -1 && fds[i].revents)
+    {
+      int wstat;
+      pid_t w = wait4(pids[i], &wstat, 0, &times[i].usage);
+      assert((w != -1) && "`wait4` failed in pipeline");
+      times[i].end = now_ns();
+      if (i == count - 1)
+        last = wstat;
+      close(fds[i].fd);
+      fds[i].fd = -1;
+      pending--;
+    }
+  }
+  // Stages without a pidfd, or all of them if `poll` failed: in order.
+  for (int i = 0; i < count; i++) if (pids[i] != -1 && !times[i].end)
+  {
+    int wstat;
+    pid_t w = wait4(pids[i], &wstat, 0, &times[i].usage);
+    assert((w != -1) && "`wait4` failed in pipeline");
+    times[i].end = now_ns();
+    if (i == count - 1)
+      last = wstat;
+    if (fds[i].fd != -1)
+      close(fds[i].fd);
+  }
+  return last;
+}
+
+// Per stage wall / CPU / max RSS / context switches to stderr, then the totals.
+static void time_report(const stage_time *restrict times, int count, uint64_t start)
+{
+  uint64_t end = start;
+  struct timeval user = {0}, sys = {0};
+  long maxrss = 0, nvcsw = 0, nivcsw = 0;
+  fprintf(stderr, "%-5s %10s %10s %10s %10s %6s %6s  %s\n", "stage", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "command");
+  for (int i = 0; i < count; i++)
+  {
+    const stage_time *t = &times[i];
+    if (!t->end)
+    {
+      fprintf(stderr, "%-5d %10s %10s %10s %10s %6s %6s  %s\n", i + 1, "-", "-", "-", "-", "-", "-", t->name);
+      continue;
+    }
+    const struct rusage *u = &t->usage;
+    fprintf(stderr, "%-5d %9.3fs %3ld.%03lds %3ld.%03lds %7ld KB %6ld %6ld  %s\n", i + 1,
+            (t->end - t->start) / 1e9,
+            (long)u->ru_utime.tv_sec, (long)u->ru_utime.tv_usec / 1000,
+            (long)u->ru_stime.tv_sec, (long)u->ru_stime.tv_usec / 1000,
+            u->ru_maxrss, u->ru_nvcsw, u->ru_nivcsw, t->name);
+    end = MAX(end, t->end);
+    timeradd(&user, &u->ru_utime, &user);
+    timeradd(&sys, &u->ru_stime, &sys);
+    maxrss = MAX(maxrss, u->ru_maxrss);
+    nvcsw += u->ru_nvcsw;
+    nivcsw += u->ru_nivcsw;
+  }
+  if (count > 1)
+    fprintf(stderr, "%-5s %9.3fs %3ld.%03lds %3ld.%03lds %7ld KB %6ld %6ld\n", "total",
+            (end - start) / 1e9,
+            (long)user.tv_sec, (long)user.tv_usec / 1000, (long)sys.tv_sec, (long)sys.tv_usec / 1000,
+            maxrss, nvcsw, nivcsw);
+}
+
+/* Launches `path` with the configured backend. Returns the child's pid, or -1 with
+ * `fds->status` set after reporting the failure.
+ * Only `Spawn_Fork` copies the shell's address space; the other two share it
+ * until `execve`, so their cost does not grow with the shell's RSS. */
+static pid_t spawn_command(const char *restrict path, char *const argv[], spawn_fds *restrict fds)
+{
+  fds->status = 0;
+  if (spawn_redirect_open(fds) == -1)
+  {
+    fds->status = 1;
+    return -1;
+  }
+  uint64_t start = trace_begin();
+  pid_t pid = -1;
+  int err = 0;
+  char **envp = vars_envp();
+  switch (spawn_backend) {
+    case Spawn_Posix:
+    {
+      posix_spawn_file_actions_t actions;
+      posix_spawn_file_actions_init(&actions);
+      if (fds->in != -1)
+        posix_spawn_file_actions_adddup2(&actions, fds->in, STDIN_FILENO);
+      if (fds->out != -1)
+        posix_spawn_file_actions_adddup2(&actions, fds->out, STDOUT_FILENO);
+      for (int i = 0; i < fds->close_count; i++)
+        posix_spawn_file_actions_addclose(&actions, fds->close[i]);
+      if (fds->redirection.t != Word)
+        posix_spawn_file_actions_adddup2(&actions, fds->redirect_fd, fds->redirect_target);
+      posix_spawnattr_t attr;
+      posix_spawnattr_init(&attr);
+      if (fds->pgid)
+      {
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, fds->pgid == -1 ? 0 : fds->pgid);
+      }
+      err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+      posix_spawnattr_destroy(&attr);
+      posix_spawn_file_actions_destroy(&actions);
+      if (err)
+        pid = -1;
+      break;
+    }
+    case Spawn_Vfork:
+    {
+      // The child runs on this stack inside our address space until `execve`.
+      // CLONE_VFORK suspends us meanwhile, so one stack serves every spawn.
+      static alignas(16) char stack[SPAWN_STACK_SIZE];
+      spawn_plan plan = {.path = path, .argv = argv, .envp = envp, .fds = fds};
+      // Keep handlers from running in the child while it shares our memory.
+      sigset_t all;
+      sigfillset(&all);
+      pthread_sigmask(SIG_SETMASK, &all, &plan.mask);
+      pid = clone(spawn_vfork_child, stack + sizeof(stack), CLONE_VM | CLONE_VFORK | SIGCHLD, &plan);
+      err = pid == -1 ? errno : plan.err;
+      pthread_sigmask(SIG_SETMASK, &plan.mask, NULL);
+      if (plan.err)
+      {
+        waitpid(pid, NULL, 0);
+        pid = -1;
+      }
+      break;
+    }
+    case Spawn_Fork:
+    {
+      pid = fork();
+      if (pid == 0)
+      {
+        if (spawn_child_setup(fds) == 0)
+          execve(path, argv, envp);
+        // The parent never hears of it, unlike the other backends: report it here.
+        fprintf(stderr, "lush: %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+      }
+      err = pid == -1 ? errno : 0;
+      break;
+    }
+    default:
+      assert(0 && "Unreachable: invalid spawn backend.");
+  }
+  if (fds->redirection.t != Word)
+    close(fds->redirect_fd);
+  if (pid == -1)
+  {
+    fprintf(stderr, "lush: %s: %s\n", argv[0], strerror(err));
+    fds->status = 127;
+  }
+  trace_end("spawn", start, argv[0]);
+  return pid;
+}
+
+/* Opens `fds->redirection`, if any, into `fds->redirect_fd`, close-on-exec.
+ * Done by the shell rather than the child, so a bad target is reported by its path
+ * in every backend. Returns -1 after reporting a failure. */
+static int spawn_redirect_open(spawn_fds *restrict fds)
+{
+  if (fds->redirection.t == Word)
+    return 0;
+  int flags;
+  fds->redirect_target = redirection_target(fds->redirection, &flags);
+  fds->redirect_fd = open(EXTRACT_TOKEN_PTR(fds->redirection), flags | O_CLOEXEC, 0666);
+  if (fds->redirect_fd == -1)
+  {
+    fprintf(stderr, "lush: %s: %s\n", EXTRACT_TOKEN_PTR(fds->redirection), strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// Applies `fds` to the current process. Only async-signal-safe calls: runs between fork / clone and exec.
+static int spawn_child_setup(const spawn_fds *restrict fds)
+{
+  if (fds->pgid && setpgid(0, fds->pgid == -1 ? 0 : fds->pgid) == -1)
+    return -1;
+  if (fds->in != -1 && dup2(fds->in, STDIN_FILENO) == -1)
+    return -1;
+  if (fds->out != -1 && dup2(fds->out, STDOUT_FILENO) == -1)
+    return -1;
+  for (int i = 0; i < fds->close_count; i++)
+    close(fds->close[i]);
+  // `dup2` leaves the copy open across exec. A descriptor that already is the target only needs the flag cleared.
+  if (fds->redirection.t != Word)
+  {
+    if (fds->redirect_fd == fds->redirect_target)
+      return fcntl(fds->redirect_fd, F_SETFD, 0);
+    if (dup2(fds->redirect_fd, fds->redirect_target) == -1)
+      return -1;
+    close(fds->redirect_fd);
+  }
+  return 0;
+}
+
+// Entry point of `Spawn_Vfork` children. Reports failures through the shared `plan`.
+static int spawn_vfork_child(void *plan)
+{
+  spawn_plan *p = plan;
+  // Handlers belong to the parent: reset them before unblocking signals.
+  struct sigaction dfl = {.sa_handler = SIG_DFL}, old;
+  for (int sig = 1; sig < NSIG; sig++)
+    if (sigaction(sig, NULL, &old) == 0 && old.sa_handler != SIG_IGN && old.sa_handler != SIG_DFL)
+      sigaction(sig, &dfl, NULL);
+  pthread_sigmask(SIG_SETMASK, &p->mask, NULL);
+  if (spawn_child_setup(p->fds) == 0)
+    execve(p->path, p->argv, p->envp);
+  p->err = errno;
+  _exit(127);
+}
+
+static void sigchld_handler(int sig)
+{
+  int saved_errno = errno;
+  jobs_reap();
+  errno = saved_errno;
+}
+
+// Collects every state change of job processes. Never waits on foreground children.
+static void jobs_reap()
+{
+  for (int j = 0; j < MAX_JOBS; j++) if (jobs[j].processes)
+    for (int i = 0; i < jobs[j].count; i++)
+    {
+      job_process *p = &jobs[j].processes[i];
+      int wstat;
+      while (p->state != Job_Done && waitpid(p->pid, &wstat, WNOHANG | WUNTRACED | WCONTINUED) > 0)
+      {
+        if (WIFSTOPPED(wstat))
+          p->state = Job_Stopped;
+        else if (WIFCONTINUED(wstat))
+          p->state = Job_Running;
+        else
+        {
+          p->status = wstat;
+          p->state = Job_Done;
+        }
+      }
+    }
+}
+
+// Lowest free slot, after dropping finished jobs if the table is full. -1 when none.
+static int job_slot()
+{
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (int j = 0; j < MAX_JOBS; j++)
+      if (!jobs[j].processes)
+        return j;
+    jobs_notify();
+  }
+  return -1;
+}
+
+/* Registers the `stages` commands starting at `a` as job `j`, run by the `count`
+ * processes in `pids`: one per stage for a pipeline, one for a whole `&&` list.
+ * `pids` may hold -1s. Children that already exited are reaped right away: their SIGCHLD came too early. */
+static void job_add(int j, const args *restrict a, int stages, pid_t pgid, const pid_t *restrict pids, int count)
+{
+  // "cmd arg | cmd arg && cmd arg"
+  size_t len = 0;
+  const args *c = a;
+  for (int i = 0; i < stages; i++, c = ADVANCE_ARGS(c))
+    for (size_t k = 0; k < c->c; k++)
+      len += strlen(c->v[k]) + 4;
+  char *command = malloc(len + 1), *w = command;
+  job_process *processes = malloc(count * sizeof(job_process));
+  assert(command && processes && "Out of memory for job.");
+  const char *link = "";
+  for (int i = 0; i < stages; i++, a = ADVANCE_ARGS(a))
+  {
+    for (size_t k = 0; k < a->c; k++)
+      w += k ? sprintf(w, " %s", a->v[k]) : sprintf(w, "%s%s", link, a->v[k]);
+    link = a->link == Pipe ? " | " : " && ";
+  }
+  for (int i = 0; i < count; i++)
+  {
+    processes[i].pid = pids[i];
+    processes[i].state = pids[i] == -1 ? Job_Done : Job_Running;
+    processes[i].status = 0;
+  }
+
+  sigset_t chld, old;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &chld, &old);
+  jobs[j] = (job){.processes = processes, .count = count, .pgid = pgid, .command = command, .notified = Job_Running};
+  jobs_reap();
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (interactive)
+    fprintf(stderr, "[%d] %d\n", j + 1, pgid);
+}
+
+static void job_remove(int j)
+{
+  sigset_t chld, old;
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &chld, &old);
+  job_process *processes = jobs[j].processes;
+  char *command = jobs[j].command;
+  jobs[j] = (job){0};
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  free(processes);
+  free(command);
+}
+
+// Done once every process is, stopped if any is.
+static enum Job_State job_state(int j)
+{
+  enum Job_State state = Job_Done;
+  for (int i = 0; i < jobs[j].count; i++)
+  {
+    enum Job_State s = jobs[j].processes[i].state;
+    if (s == Job_Stopped)
+      return Job_Stopped;
+    if (s == Job_Running)
+      state = Job_Running;
+  }
+  return state;
+}
+
+/* Waits while job `j` runs. `foreground` continues it first and, when interactive,
+ * hands it the terminal until it finishes or stops. Finished jobs are removed. */
+static void job_wait(int j, int foreground)
+{
+  // SIGTTOU is blocked so the shell may take the terminal back from the background.
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigaddset(&block, SIGTTOU);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  int terminal = foreground && interactive && tcsetpgrp(STDIN_FILENO, jobs[j].pgid) == 0;
+  if (foreground)
+  {
+    for (int i = 0; i < jobs[j].count; i++)
+      if (jobs[j].processes[i].state == Job_Stopped)
+        jobs[j].processes[i].state = Job_Running;
+    kill(-jobs[j].pgid, SIGCONT);
+  }
+  while (job_state(j) == Job_Running)
+    sigsuspend(&old);
+  if (terminal)
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  enum Job_State state = job_state(j);
+  last_status = state == Job_Done ? wait_status(jobs[j].processes[jobs[j].count - 1].status) : 128 + SIGTSTP;
+  if (state == Job_Done)
+    job_remove(j);
+  else if (foreground)
+  {
+    fputc('\n', stderr);
+    job_print(j, state);
+    jobs[j].notified = state;
+  }
+}
+
+/* Job `%n`, `n` or `%+` / `%%` for the current one. With `by_pid`, a bare number
+ * is the pid of any of its processes instead. -1 when there is no such job. */
+static int job_find(const char *restrict spec, int by_pid)
+{
+  if (!spec || strcmp(spec, "%+") == 0 || strcmp(spec, "%%") == 0)
+    return job_current();
+  int is_job = *spec == '%';
+  if (!is_decimal_num(spec + is_job))
+    return -1;
+  long n = atol(spec + is_job);
+  if (by_pid && !is_job)
+  {
+    for (int j = 0; j < MAX_JOBS; j++) if (jobs[j].processes)
+      for (int i = 0; i < jobs[j].count; i++)
+        if (jobs[j].processes[i].pid == n)
+          return j;
+    return -1;
+  }
+  return n >= 1 && n <= MAX_JOBS && jobs[n - 1].processes ? n - 1 : -1;
+}
+
+// The newest job, -1 when there are none.
+static int job_current()
+{
+  for (int j = MAX_JOBS - 1; j >= 0; j--)
+    if (jobs[j].processes)
+      return j;
+  return -1;
+}
+
+// "[1]+  Running                 sleep 5 &"
+static void job_print(int j, enum Job_State state)
+{
+  char what[32];
+  if (state == Job_Running)
+    snprintf(what, sizeof(what), "Running");
+  else if (state == Job_Stopped)
+    snprintf(what, sizeof(what), "Stopped");
+  else
+  {
+    int wstat = jobs[j].processes[jobs[j].count - 1].status;
+    if (WIFSIGNALED(wstat))
+      snprintf(what, sizeof(what), "%s", strsignal(WTERMSIG(wstat)));
+    else if (WEXITSTATUS(wstat))
+      snprintf(what, sizeof(what), "Exit %d", WEXITSTATUS(wstat));
+    else snprintf(what, sizeof(what), "Done");
+  }
+  out_printf("[%d]%c  %-24s%s%s\n", j + 1, j == job_current() ? '+' : ' ', what, jobs[j].command,
+         state == Job_Running ? " &" : "");
+}
+
+// Reports jobs that stopped or finished since the last prompt and frees finished ones.
+static void jobs_notify()
+{
+  for (int j = 0; j < MAX_JOBS; j++) if (jobs[j].processes)
+  {
+    enum Job_State state = job_state(j);
+    if (state != jobs[j].notified && state != Job_Running && interactive)
+      job_print(j, state);
+    jobs[j].notified = state;
+    if (state == Job_Done)
+      job_remove(j);
+  }
+  out_flush();
+}
+
+static void builtin_cd(const args *restrict a, arena *restrict allocator)
+{
+  if ((a->c == 1) || (a->c == 2 && (strcmp(a->v[1], "~")) == 0))
+  {
+    const char *home = var_get("HOME");
+    assert(home && "HOME environment variable not found.");
+    if (chdir(home))
+    {
+      fprintf(stderr, "cd: %s: No such file or directory\n", home);
+      last_status = 1;
+    }
+  }
+  else if (a->c == 2 && chdir(a->v[1]))
+  {
+    fprintf(stderr, "cd: %s: No such file or directory\n", a->v[1]);
+    last_status = 1;
+  }
+  else if (a->c >= 3)
+  {
+    fprintf(stderr, "lush: cd: too many arguments\n");
+    last_status = 1;
+  }
+}
+
+static void builtin_pwd(const args *restrict a, arena *restrict allocator)
+{
+  char *cwd = arena_push(allocator, alignof(char), MAX_CWD_SIZE);
+  char *ptr = getcwd(cwd, MAX_CWD_SIZE);
+  assert(ptr && "`getcwd` failed.");
+  out_printf("%s\n", cwd);
+}
+
+static void builtin_echo(const args *restrict a, arena *restrict allocator)
+{
+  size_t end = a->c - 1;
+  if (end)
+  {
+    for (size_t i = 1; i < end; ++i)
+    {
+      out_write(a->v[i], strlen(a->v[i]));
+      out_write(" ", 1);
+    }
+    out_write(a->v[end], strlen(a->v[end]));
+    out_write("\n", 1);
+  }
+}
+
+static void builtin_type(const args *restrict a, arena *restrict allocator)
+{
+  for (int i = 1; i < a->c; i++)
+  {
+    char *arg = a->v[i];
+    const char *full_path = find_executable(arg);
+    if (full_path)
+      out_printf("%s is %s\n", arg, full_path);
+    // Default case: keep stdout and stderr in order.
+    else
+    {
+      out_flush();
+      fprintf(stderr, "%s: not found\n", arg);
+      last_status = 1;
+    }
+  }
+}
+
+static void builtin_exit(const args *restrict a, arena *restrict allocator)
+{
+  if (a->c > 2)
+  {
+    fprintf(stderr, "lush: exit: too many arguments\n");
+    last_status = 1;
+  }
+  else
+  {
+    history_store_save(history_store_path(), session_command_count, 0);
+    if (a->c == 1)
+      exit(0);
+    else if (!is_decimal_num(a->v[1]))
+      exit(2);
+    else
+      exit((unsigned char) atoll(a->v[1]));
+  }
+}
+
+static void builtin_history(const args *restrict a, arena *restrict allocator)
+{
+  if (a->c > 3)
+  {
+    fprintf(stderr, "lush: history: too many arguments\n");
+    last_status = 1;
+  }
+  // Print history.
+  else if (a->c < 3)
+  {
+    history_store_join();
+    uint32_t skip = 0;
+    if (a->c == 2)
+    {
+      if (!is_decimal_num(a->v[1]))
+      {
+        fprintf(stderr, "lush: history: %s: numeric argument required\n", a->v[1]);
+        last_status = 1;
+        return;
+      }
+      long limit = atol(a->v[1]);
+      if (limit < 0)
+      {
+        fprintf(stderr, "lush: history: %s: invalid option\n", a->v[1]);
+        last_status = 2;
+        return;
+      }
+      skip = limit < history.visible ? history.visible - limit : 0;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < history.count; i++) if (history.lines[i].data && n++ >= skip)
+      out_printf("%5u  %.*s\n", n, (int)history.lines[i].len, history.lines[i].data);
+  }
+  // (a->c == 3)
+  // Read / write / append file.
+  else if (strcmp(a->v[1], "-r") == 0)
+    history_store_import(a->v[2]);
+  else if (strcmp(a->v[1], "-w") == 0)
+    history_store_save(a->v[2], UINT32_MAX, 1);
+  else if (strcmp(a->v[1], "-s") == 0)
+  {
+    // Matches oldest first, numbered like a plain listing.
+    history_store_join();
+    uint32_t *found = arena_push(allocator, alignof(uint32_t), MAX(history.count, 1) * sizeof(uint32_t));
+    uint32_t n = history_store_search(a->v[2], strlen(a->v[2]), UINT32_MAX, found, UINT32_MAX);
+    uint32_t number = 0, line = 0;
+    while (n-- > 0)
+    {
+      for (; line <= found[n]; line++)
+        number += history.lines[line].data != NULL;
+      out_printf("%5u  %.*s\n", number, (int)history.lines[found[n]].len, history.lines[found[n]].data);
+    }
+  }
+  else if (strcmp(a->v[1], "-a") == 0)
+  {
+    history_store_save(a->v[2], session_command_count, 0);
+    session_command_count = 0;
+  }
+  else
+  {
+    fprintf(stderr, "lush: history: %s: invalid option\n", a->v[1]);
+    last_status = 2;
+  }
+}
+
+// HISTFILE, or `~/.history` like Readline. NULL without either.
+static const char* history_store_path()
+{
+  static char path[PATH_MAX];
+  const char *file = var_get("HISTFILE"), *home = var_get("HOME");
+  if (file)
+    return file;
+  if (!home || snprintf(path, sizeof(path), "%s/.history", home) >= (int)sizeof(path))
+    return NULL;
+  return path;
+}
+
+/* Maps `path`, gives Readline its newest lines for the arrow keys
+ * and leaves the full line index to a background thread. */
+static void history_store_start(const char *restrict path)
+{
+  const char *control = var_get("HISTCONTROL");
+  if (control)
+  {
+    history.ignoredups = strstr(control, "ignoredups") || strstr(control, "ignoreboth");
+    history.ignorespace = strstr(control, "ignorespace") || strstr(control, "ignoreboth");
+    history.erasedups = strstr(control, "erasedups") != NULL;
+  }
+
+  int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+  struct stat st;
+  if (fd == -1)
+    return;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    history.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    history.map_size = history.map == MAP_FAILED ? 0 : st.st_size;
+    if (history.map == MAP_FAILED)
+      history.map = NULL;
+  }
+  close(fd);
+  if (!history.map)
+    return;
+
+  // Newest lines, found backwards from the end.
+  char *end = history.map + history.map_size;
+  if (end[-1] == '\n')
+    end--;
+  char *start = end;
+  for (int n = 0; n < HISTORY_RECENT && start > history.map; n++)
+  {
+    char *nl = memrchr(history.map, '\n', start - history.map);
+    if (n == 0)
+      history.last = (str){nl ? nl + 1 : history.map, end - (nl ? nl + 1 : history.map)};
+    start = nl ? nl : history.map;
+  }
+  // A HISTFILE of one newline leaves `start == end` on that newline: nothing to add.
+  if (start < end && *start == '\n')
+    start++;
+  if (start < end)
+  {
+    char *copy = malloc(end - start + 1);
+    assert(copy && "Out of memory for history.");
+    memcpy(copy, start, end - start);
+    copy[end - start] = '\0';
+    for (char *line = copy, *nl; line; line = nl ? nl + 1 : NULL)
+    {
+      if ((nl = strchr(line, '\n')))
+        *nl = '\0';
+      add_history(line);
+    }
+    free(copy);
+  }
+
+  // The loader leaves signals to the main thread.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  history.loading = pthread_create(&history.loader, NULL, history_store_index, NULL) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (!history.loading)
+    history_store_index(NULL);
+}
+
+// Loader thread: indexes every line of the mapping, then drops older duplicates for erasedups.
+static void* history_store_index(void*)
+{
+  uint64_t start = trace_begin();
+  const char *p = history.map, *end = history.map + history.map_size;
+  uint32_t count = 0;
+  for (const char *nl; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1)
+    count++;
+  count += p < end; // Unterminated last line.
+
+  history.capacity = MAX(count, 64);
+  history.lines = malloc(history.capacity * sizeof(str));
+  assert(history.lines && "Out of memory for history.");
+  p = history.map;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    const char *nl = memchr(p, '\n', end - p);
+    if (!nl)
+      nl = end;
+    history.lines[i] = (str){(char*)p, nl - p};
+    p = nl + 1;
+  }
+  history.count = history.visible = count;
+
+  if (history.erasedups)
+  {
+    // Newest first, so the survivor of each duplicate run is the newest one.
+    history.set_size = 64;
+    while (history.set_size < 2 * count)
+      history.set_size <<= 1;
+    history.set = malloc(history.set_size * sizeof(uint32_t));
+    assert(history.set && "Out of memory for history.");
+    memset(history.set, 0xff, history.set_size * sizeof(uint32_t));
+    for (uint32_t i = count; i-- > 0;)
+    {
+      uint32_t *slot = history_store_slot(history.lines[i]);
+      if (*slot == UINT32_MAX)
+      {
+        *slot = i;
+        history.set_used++;
+      }
       else
       {
-        char *read = start, *write = start;
-        while (read < p)
-        {
-          char c = *read++;
-          if (c == '\'')
-          {
-            while (*read != '\'')
-              *write++ = *read++;
-            read++;
-          }
-          else if (c == '\\')
-            *write++ = *read++;
-          else if (c == '"')
-          {
-            while (*read != '"')
-              if (*read == '\\') // ", \, $, `, and newline
-              {
-                switch (*(read +1))
-                {
-                  case '"':
-                  case '\\':
-                  case '$':
-                  case '`':
-                  case '\n':
-                    *write++ = *(read + 1);
-                    read += 2;
-                    break;
-                  default:
-                    *write++ = *read++;
-                    break;
-                }
-              }
-              else *write++ = *read++;
-            read++;
-          }
-          else *write++ = c;
-        }
-        *(write - 1) = '\0';
+        history.lines[i].data = NULL;
+        history.visible--;
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < count; i++)
+    if (history.lines[i].data)
+      history_store_grams(i);
+  trace_end("history_store_index", start, NULL);
+  return NULL;
+}
+
+// Waits for the index and adds the lines typed meanwhile.
+static void history_store_join()
+{
+  if (history.loading)
+  {
+    pthread_join(history.loader, NULL);
+    history.loading = 0;
+  }
+  // Nothing else reaches `text` before the join: pending lines start it.
+  char *line = history.text.data;
+  uint32_t pending = history.pending;
+  history.pending = 0;
+  for (uint32_t i = 0; i < pending; i++)
+  {
+    size_t len = strlen(line);
+    history_store_insert((str){line, len});
+    line += len + 1;
+  }
+}
+
+/* Records a line typed this session, as HISTCONTROL allows. Returns whether it was kept.
+ * Does not wait for the index: until it is joined the line just queues in `text`. */
+static int history_store_add(const char *restrict line)
+{
+  size_t len = strlen(line);
+  if (history.ignorespace && *line == ' ')
+    return 0;
+  if (history.ignoredups && history.last.data && history.last.len == len && memcmp(history.last.data, line, len) == 0)
+    return 0;
+  char *copy = arena_push(&history.text, alignof(char), len + 1);
+  memcpy(copy, line, len + 1);
+  history.last = (str){copy, len};
+  if (history.loading || history.pending)
+    history.pending++;
+  else history_store_insert(history.last);
+  return 1;
+}
+
+// Appends to the joined index. erasedups drops the line's previous copy.
+static void history_store_insert(str line)
+{
+  if (history.count == history.capacity)
+  {
+    history.capacity = MAX(2 * history.capacity, 64);
+    history.lines = realloc(history.lines, history.capacity * sizeof(str));
+    assert(history.lines && "Out of memory for history.");
+  }
+  if (history.erasedups)
+  {
+    if (2 * (history.set_used + 1) > history.set_size)
+    {
+      uint32_t *old = history.set, old_size = history.set_size;
+      history.set_size = MAX(2 * old_size, 64);
+      history.set = malloc(history.set_size * sizeof(uint32_t));
+      assert(history.set && "Out of memory for history.");
+      memset(history.set, 0xff, history.set_size * sizeof(uint32_t));
+      for (uint32_t i = 0; i < old_size; i++)
+        if (old[i] != UINT32_MAX)
+          *history_store_slot(history.lines[old[i]]) = old[i];
+      free(old);
+    }
+    uint32_t *slot = history_store_slot(line);
+    if (*slot == UINT32_MAX)
+      history.set_used++;
+    else
+    {
+      history.lines[*slot].data = NULL;
+      history.visible--;
+    }
+    *slot = history.count;
+  }
+  history.lines[history.count++] = line;
+  history.visible++;
+  history_store_grams(history.count - 1);
+}
+
+// Slot of `line` in `set`: its index, or the empty slot it would take.
+static uint32_t* history_store_slot(str line)
+{
+  uint32_t mask = history.set_size - 1;
+  for (uint32_t i = hash_bytes(line.data, line.len) & mask; ; i = (i + 1) & mask)
+  {
+    uint32_t *slot = &history.set[i];
+    if (*slot == UINT32_MAX)
+      return slot;
+    str other = history.lines[*slot];
+    if (other.len == line.len && memcmp(other.data, line.data, line.len) == 0)
+      return slot;
+  }
+}
+
+// Adds line `i`, the newest so far, to the posting list of each of its trigrams.
+static void history_store_grams(uint32_t i)
+{
+  const uint8_t *p = (const uint8_t*)history.lines[i].data;
+  for (size_t k = 0; k + 2 < history.lines[i].len; k++)
+  {
+    trigram_posting *g = trigram_slot(p[k] << 16 | p[k+1] << 8 | p[k+2]);
+    if (g->count && g->last == i)
+      continue; // Repeated within the line.
+    if (g->len + 5 > g->capacity)
+    {
+      g->capacity = MAX(2 * g->capacity, 8);
+      g->data = realloc(g->data, g->capacity);
+      assert(g->data && "Out of memory for history trigrams.");
+    }
+    uint32_t delta = g->count ? i - g->last : i;
+    do
+    {
+      g->data[g->len++] = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+      delta >>= 7;
+    } while (delta);
+    g->last = i;
+    g->count++;
+  }
+}
+
+// Posting list of `key`, created empty when missing.
+static trigram_posting* trigram_slot(uint32_t key)
+{
+  if (2 * (history.gram_used + 1) > history.gram_size)
+  {
+    trigram_posting *old = history.grams;
+    uint32_t old_size = history.gram_size;
+    history.gram_size = MAX(2 * old_size, 1 << 16);
+    history.grams = malloc(history.gram_size * sizeof(trigram_posting));
+    assert(history.grams && "Out of memory for history trigrams.");
+    for (uint32_t i = 0; i < history.gram_size; i++)
+      history.grams[i].key = UINT32_MAX;
+    history.gram_used = 0;
+    for (uint32_t i = 0; i < old_size; i++)
+      if (old[i].key != UINT32_MAX)
+        *trigram_slot(old[i].key) = old[i];
+    free(old);
+  }
+  uint32_t mask = history.gram_size - 1;
+  for (uint32_t i = (key * 0x9e3779b1u) >> 8 & mask; ; i = (i + 1) & mask)
+  {
+    trigram_posting *g = &history.grams[i];
+    if (g->key == key)
+      return g;
+    if (g->key == UINT32_MAX)
+    {
+      *g = (trigram_posting){.key = key};
+      history.gram_used++;
+      return g;
+    }
+  }
+}
+
+/* Fills `out` with up to `max` indices of lines below `before` that contain `pattern`,
+ * newest first. Returns how many. Candidates come from the pattern's rarest trigram
+ * and are confirmed with `memmem`; patterns under three bytes scan from the newest line. */
+static uint32_t history_store_search(const char *restrict pattern, size_t len, uint32_t before, uint32_t *restrict out, uint32_t max)
+{
+  history_store_join();
+  before = MIN(before, history.count);
+  uint32_t found = 0;
+  if (len < 3)
+  {
+    for (uint32_t i = before; i-- > 0 && found < max;)
+      if (history.lines[i].data && memmem(history.lines[i].data, history.lines[i].len, pattern, len))
+        out[found++] = i;
+    return found;
+  }
+
+  const trigram_posting *rarest = NULL;
+  const uint8_t *p = (const uint8_t*)pattern;
+  for (size_t k = 0; k + 2 < len; k++)
+  {
+    uint32_t key = p[k] << 16 | p[k+1] << 8 | p[k+2];
+    const trigram_posting *g = NULL;
+    uint32_t mask = history.gram_size - 1;
+    for (uint32_t i = (key * 0x9e3779b1u) >> 8 & mask; history.gram_size && history.grams[i].key != UINT32_MAX; i = (i + 1) & mask)
+      if (history.grams[i].key == key)
+      {
+        g = &history.grams[i];
+        break;
+      }
+    if (!g)
+      return 0; // No line has this trigram.
+    if (!rarest || g->count < rarest->count)
+      rarest = g;
+  }
+
+  // Deltas only decode forwards: unpack, then walk back from the newest.
+  uint32_t *candidates = malloc(rarest->count * sizeof(uint32_t));
+  assert(candidates && "Out of memory for history search.");
+  uint32_t n = 0, line = 0;
+  for (uint32_t at = 0; at < rarest->len;)
+  {
+    uint32_t delta = 0;
+    for (int shift = 0; ; shift += 7)
+    {
+      uint8_t b = rarest->data[at++];
+      delta |= (uint32_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        break;
+    }
+    line = n ? line + delta : delta;
+    candidates[n++] = line;
+  }
+  for (uint32_t c = n; c-- > 0 && found < max;)
+  {
+    uint32_t i = candidates[c];
+    if (i < before && history.lines[i].data && memmem(history.lines[i].data, history.lines[i].len, pattern, len))
+      out[found++] = i;
+  }
+  free(candidates);
+  return found;
+}
+
+/* Ctrl-R: incremental search backed by the trigram index. Ctrl-R again steps to older
+ * matches, Ctrl-G gives up, and any other key takes the match and is then handled as usual. */
+static int history_search_key(int count, int key)
+{
+  char pattern[256];
+  size_t len = 0;
+  uint32_t match = UINT32_MAX;
+  int failed = 0, c;
+  for (;;)
+  {
+    pattern[len] = '\0';
+    str shown = match != UINT32_MAX ? history.lines[match] : (str){"", 0};
+    rl_message("(%sreverse-i-search)`%s': %.*s", failed ? "failed " : "", pattern, (int)shown.len, shown.data);
+    c = rl_read_key();
+    uint32_t before;
+    if (c == CTRL('G'))
+    {
+      rl_clear_message();
+      return 0;
+    }
+    else if (c == CTRL('R'))
+      before = match;
+    else if ((c == RUBOUT || c == CTRL('H')) && len)
+    {
+      len--;
+      before = UINT32_MAX;
+    }
+    else if (c >= ' ' && c < RUBOUT && len + 1 < sizeof(pattern))
+    {
+      pattern[len++] = c;
+      // Keep the current match while it still matches.
+      before = match == UINT32_MAX ? UINT32_MAX : match + 1;
+    }
+    else break;
+
+    uint32_t next;
+    failed = len && history_store_search(pattern, len, before, &next, 1) == 0;
+    if (!len)
+      match = UINT32_MAX;
+    else if (!failed)
+      match = next;
+  }
+
+  rl_clear_message();
+  if (match != UINT32_MAX)
+  {
+    char *line = strndup(history.lines[match].data, history.lines[match].len);
+    assert(line && "Out of memory for history search.");
+    rl_replace_line(line, 0);
+    rl_point = rl_end;
+    free(line);
+  }
+  rl_execute_next(c);
+  return 0;
+}
+
+/* Writes the newest `n` lines to `path` with one `write` under an exclusive `flock`:
+ * O_APPEND keeps concurrent sessions from overwriting each other. `truncate` replaces the file
+ * by renaming a new one over it, since other sessions may have the old one mapped. */
+static void history_store_save(const char *restrict path, uint32_t n, int truncate)
+{
+  if (!path || (n == 0 && !truncate))
+    return;
+  history_store_join();
+  uint32_t first = history.count;
+  size_t size = 0;
+  for (uint32_t kept = 0; first > 0 && kept < n; first--)
+    if (history.lines[first - 1].data)
+    {
+      size += history.lines[first - 1].len + 1;
+      kept++;
+    }
+  char *buf = malloc(size + 1), *w = buf;
+  assert(buf && "Out of memory for history.");
+  for (uint32_t i = first; i < history.count; i++) if (history.lines[i].data)
+  {
+    memcpy(w, history.lines[i].data, history.lines[i].len);
+    w += history.lines[i].len;
+    *w++ = '\n';
+  }
+
+  int fd;
+  for (;;)
+  {
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+      break;
+    flock(fd, LOCK_EX);
+    // A `history -w` may have renamed a new file over the one locked: lock that one instead.
+    struct stat locked, current;
+    if (fstat(fd, &locked) == 0 && stat(path, &current) == 0
+        && locked.st_dev == current.st_dev && locked.st_ino == current.st_ino)
+      break;
+    close(fd);
+  }
+  if (fd == -1)
+    fprintf(stderr, "lush: history: %s: %s\n", path, strerror(errno));
+  else if (truncate)
+  {
+    // Still under the lock, so appends wait and then follow the rename.
+    char tmp[PATH_MAX + 8];
+    int out = -1;
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) < (int)sizeof(tmp))
+      out = mkostemp(tmp, O_CLOEXEC);
+    int ok = out != -1 && write_all(out, buf, size);
+    ok = (out == -1 || close(out) == 0) && ok;
+    if (!ok || rename(tmp, path) != 0)
+    {
+      fprintf(stderr, "lush: history: %s: %s\n", path, strerror(errno));
+      if (out != -1)
+        unlink(tmp);
+    }
+    close(fd); // Releases the lock.
+  }
+  else
+  {
+    write_all(fd, buf, size);
+    close(fd); // Releases the lock.
+  }
+  free(buf);
+}
+
+// `history -r`: appends the lines of `path` to this session's history.
+static void history_store_import(const char *restrict path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1)
+  {
+    fprintf(stderr, "lush: history: %s: %s\n", path, strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+  history_store_join();
+  char *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+  for (char *p = map, *end = map + st.st_size, *nl; p < end; p = nl + 1)
+  {
+    if (!(nl = memchr(p, '\n', end - p)))
+      nl = end;
+    char *copy = arena_push(&history.text, alignof(char), nl - p + 1);
+    memcpy(copy, p, nl - p);
+    copy[nl - p] = '\0';
+    history_store_insert((str){copy, nl - p});
+    add_history(copy);
+  }
+  munmap(map, st.st_size);
+}
+
+static void builtin_jobs(const args *restrict a, arena *restrict allocator)
+{
+  for (int j = 0; j < MAX_JOBS; j++) if (jobs[j].processes)
+  {
+    enum Job_State state = job_state(j);
+    job_print(j, state);
+    jobs[j].notified = state;
+  }
+}
+
+static void builtin_wait(const args *restrict a, arena *restrict allocator)
+{
+  if (a->c == 1)
+  {
+    for (int j = 0; j < MAX_JOBS; j++)
+      if (jobs[j].processes)
+        job_wait(j, 0);
+    return;
+  }
+  for (int i = 1; i < a->c; i++)
+  {
+    int j = job_find(a->v[i], 1);
+    if (j == -1)
+    {
+      fprintf(stderr, "lush: wait: %s: no such job\n", a->v[i]);
+      last_status = 127;
+    }
+    else job_wait(j, 0);
+  }
+}
+
+static void builtin_fg(const args *restrict a, arena *restrict allocator)
+{
+  if (a->c > 2)
+  {
+    fprintf(stderr, "lush: fg: too many arguments\n");
+    last_status = 1;
+    return;
+  }
+  int j = job_find(a->v[1], 0);
+  if (j == -1)
+  {
+    fprintf(stderr, "lush: fg: %s: no such job\n", a->c == 2 ? a->v[1] : "current");
+    last_status = 1;
+    return;
+  }
+  out_printf("%s\n", jobs[j].command);
+  // Before the job owns the terminal.
+  out_flush();
+  job_wait(j, 1);
+}
+
+static void builtin_bg(const args *restrict a, arena *restrict allocator)
+{
+  for (int i = 1; i < a->c || i == 1; i++)
+  {
+    int j = job_find(a->v[i], 0);
+    if (j == -1)
+    {
+      fprintf(stderr, "lush: bg: %s: no such job\n", a->c > 1 ? a->v[i] : "current");
+      last_status = 1;
+      continue;
+    }
+    for (int k = 0; k < jobs[j].count; k++)
+      if (jobs[j].processes[k].state == Job_Stopped)
+        jobs[j].processes[k].state = Job_Running;
+    kill(-jobs[j].pgid, SIGCONT);
+    jobs[j].notified = Job_Running;
+    out_printf("[%d]%c %s &\n", j + 1, j == job_current() ? '+' : ' ', jobs[j].command);
+  }
+}
+
+// The parser strips `time` from the start of a pipeline. What reaches here timed nothing.
+static void builtin_time(const args *restrict a, arena *restrict allocator)
+{
+  if (a->c > 1)
+  {
+    fprintf(stderr, "lush: time: only valid at the start of a pipeline\n");
+    last_status = 1;
+  }
+  else
+  {
+    stage_time t = {.name = ""};
+    time_report(&t, 0, 0);
+  }
+}
+
+// `hash [-r] [-l] [name...]`: forget everything, list what is remembered, or resolve `name`s again.
+static void builtin_hash(const args *restrict a, arena *restrict allocator)
+{
+  int list = 0, reset = 0, names = 0;
+  for (int i = 1; i < a->c; i++)
+  {
+    if (strcmp(a->v[i], "-r") == 0)
+      reset = 1;
+    else if (strcmp(a->v[i], "-l") == 0)
+      list = 1;
+    else if (a->v[i][0] == '-')
+    {
+      fprintf(stderr, "lush: hash: %s: invalid option\n", a->v[i]);
+      last_status = 2;
+      return;
+    }
+    else names++;
+  }
+  if (reset)
+    command_hash_clear();
+
+  strings_ready();
+  for (int i = 1; i < a->c; i++) if (a->v[i][0] != '-')
+  {
+    // Expire whatever is remembered, then look again.
+    hashed_command *e = command_hash_slot(a->v[i]);
+    if (e->name)
+      e->generation = watch.generation - 1;
+    const char *path = command_hash_find(a->v[i]);
+    e = command_hash_slot(a->v[i]);
+    if (!path)
+    {
+      out_flush();
+      fprintf(stderr, "lush: hash: %s: not found\n", a->v[i]);
+      last_status = 1;
+    }
+    else if (e->name)
+      e->hits = 0;
+  }
+  if (names || (reset && !list))
+    return;
+
+  int empty = 1;
+  for (uint32_t i = 0; i < hashed.size; i++)
+  {
+    const hashed_command *e = &hashed.slots[i];
+    if (!e->name || !e->path)
+      continue;
+    if (empty && !list)
+      out_printf("hits\tcommand\n");
+    empty = 0;
+    if (list)
+      out_printf("builtin hash -p %s %s\n", e->path, e->name);
+    else out_printf("%4u\t%s\n", e->hits, e->path);
+  }
+  if (empty)
+    out_printf("hash: hash table empty\n");
+}
+
+// `export [NAME[=value]...]`: sets and exports, or lists what is exported.
+static void builtin_export(const args *restrict a, arena *restrict allocator)
+{
+  if (a->c == 1)
+  {
+    // Sorted, like the PATH index.
+    temp_entry *entries = arena_push(allocator, alignof(temp_entry), 2 * MAX(vars.used, 1) * sizeof(temp_entry));
+    size_t n = 0;
+    for (uint32_t i = 0; i < vars.size; i++) if (vars.slots[i].entry && vars.slots[i].exported)
+      entries[n++] = (temp_entry){.name = vars.slots[i].entry};
+    temp_entry_radix_sort(entries, entries + n, n, 0);
+    for (size_t i = 0; i < n; i++)
+    {
+      const char *eq = strchr(entries[i].name, '=');
+      out_printf("export %.*s=\"%s\"\n", (int)(eq - entries[i].name), entries[i].name, eq + 1);
+    }
+    return;
+  }
+  for (int i = 1; i < a->c; i++)
+  {
+    const char *arg = a->v[i];
+    size_t len = var_name_len(arg);
+    if (!len || (arg[len] && arg[len] != '='))
+    {
+      fprintf(stderr, "lush: export: `%s': not a valid identifier\n", arg);
+      last_status = 1;
+    }
+    else if (arg[len] == '=')
+      var_set(arg, len, arg + len + 1, 1);
+    // `export NAME` of an unset NAME is a no-op.
+    else if (var_lookup(arg, len))
+      var_set(arg, len, var_lookup(arg, len), 1);
+  }
+}
+
+static void builtin_unset(const args *restrict a, arena *restrict allocator)
+{
+  for (int i = 1; i < a->c; i++)
+  {
+    size_t len = var_name_len(a->v[i]);
+    if (!len || a->v[i][len])
+    {
+      fprintf(stderr, "lush: unset: `%s': not a valid identifier\n", a->v[i]);
+      last_status = 1;
+    }
+    else var_unset(a->v[i], len);
+  }
+}
+
+// Loads `environ`. Before any thread starts: threads only read the table.
+static void vars_init()
+{
+  if (vars.size)
+    return;
+  vars.size = VAR_TABLE_INITIAL_SIZE;
+  vars.slots = calloc(vars.size, sizeof(shell_var));
+  assert(vars.slots && "calloc failed.");
+  for (char **e = environ; *e; e++)
+  {
+    const char *eq = strchr(*e, '=');
+    if (eq)
+      var_store(*e, eq - *e, eq + 1, 1);
+  }
+}
+
+// The slot holding `name[0..len)`, or the free slot where it belongs.
+static shell_var* var_slot(const char *restrict name, size_t len)
+{
+  vars_init();
+  uint32_t mask = vars.size - 1;
+  for (uint32_t i = hash_bytes(name, len) & mask; ; i = (i + 1) & mask)
+  {
+    shell_var *v = &vars.slots[i];
+    if (!v->entry || (v->name_len == len && memcmp(v->entry, name, len) == 0))
+      return v;
+  }
+}
+
+// Value of `name[0..len)`, or NULL when unset.
+static const char* var_lookup(const char *restrict name, size_t len)
+{
+  const shell_var *v = var_slot(name, len);
+  return v->entry ? v->entry + len + 1 : NULL;
+}
+
+// `getenv` for the shell's own variables.
+static const char* var_get(const char *restrict name)
+{
+  return var_lookup(name, strlen(name));
+}
+
+// Sets `name[0..len)` to `value`. `exported` 1 exports it; 0 keeps a known variable's flag.
+static void var_store(const char *restrict name, size_t len, const char *restrict value, int exported)
+{
+  if (4 * (vars.used + 1) > 3 * vars.size)
+  {
+    shell_var *old = vars.slots;
+    uint32_t old_size = vars.size;
+    vars.size *= 2;
+    vars.slots = calloc(vars.size, sizeof(shell_var));
+    assert(vars.slots && "calloc failed.");
+    for (uint32_t i = 0; i < old_size; i++) if (old[i].entry)
+      *var_slot(old[i].entry, old[i].name_len) = old[i];
+    free(old);
+  }
+  shell_var *v = var_slot(name, len);
+  size_t value_len = strlen(value);
+  char *entry = malloc(len + 1 + value_len + 1);
+  assert(entry && "malloc failed.");
+  memcpy(entry, name, len);
+  entry[len] = '=';
+  memcpy(entry + len + 1, value, value_len + 1);
+  if (v->entry)
+    free(v->entry);
+  else vars.used++;
+  *v = (shell_var){.entry = entry, .name_len = len, .exported = exported || v->exported};
+  if (v->exported)
+  {
+    free(vars.envp);
+    vars.envp = NULL;
+  }
+}
+
+// Assignment from a command. Waits out the first index build, the one other thread reading variables.
+static void var_set(const char *restrict name, size_t len, const char *restrict value, int exported)
+{
+  pthread_once(&strings_once, build_autocomplete_strings);
+  var_store(name, len, value, exported);
+  if (len == 4 && memcmp(name, "PATH", 4) == 0)
+    path_index_rebuild();
+}
+
+static void var_unset(const char *restrict name, size_t len)
+{
+  pthread_once(&strings_once, build_autocomplete_strings);
+  shell_var *v = var_slot(name, len);
+  if (!v->entry)
+    return;
+  if (v->exported)
+  {
+    free(vars.envp);
+    vars.envp = NULL;
+  }
+  free(v->entry);
+  vars.used--;
+  // Backward shift: pull later members of the probe run into the hole.
+  uint32_t mask = vars.size - 1, hole = v - vars.slots;
+  for (uint32_t i = (hole + 1) & mask; vars.slots[i].entry; i = (i + 1) & mask)
+  {
+    uint32_t home = hash_bytes(vars.slots[i].entry, vars.slots[i].name_len) & mask;
+    // Movable unless its home lies cyclically in (hole, i].
+    if (((i - home) & mask) >= ((i - hole) & mask))
+    {
+      vars.slots[hole] = vars.slots[i];
+      hole = i;
+    }
+  }
+  vars.slots[hole] = (shell_var){0};
+  if (len == 4 && memcmp(name, "PATH", 4) == 0)
+    path_index_rebuild();
+}
+
+// NULL terminated `NAME=value` list of exported variables, rebuilt only after a change.
+static char** vars_envp()
+{
+  if (vars.envp)
+    return vars.envp;
+  vars_init();
+  vars.envp = malloc((vars.used + 1) * sizeof(char*));
+  assert(vars.envp && "malloc failed.");
+  size_t n = 0;
+  for (uint32_t i = 0; i < vars.size; i++) if (vars.slots[i].entry && vars.slots[i].exported)
+    vars.envp[n++] = vars.slots[i].entry;
+  vars.envp[n] = NULL;
+  return vars.envp;
+}
+
+// Length of the variable name `s` starts with, 0 when it starts with none.
+static size_t var_name_len(const char *restrict s)
+{
+  if (!(*s == '_' || (*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z')))
+    return 0;
+  size_t n = 1;
+  while (s[n] == '_' || (s[n] >= 'a' && s[n] <= 'z') || (s[n] >= 'A' && s[n] <= 'Z') || (s[n] >= '0' && s[n] <= '9'))
+    n++;
+  return n;
+}
+
+// A command of only `NAME=value` words sets those shell variables. Returns 0 for any other command.
+static int var_assignments(const args *restrict a)
+{
+  if (!var_assignments_only(a))
+    return 0;
+  for (int i = 0; i < a->c; i++)
+  {
+    size_t len = var_name_len(a->v[i]);
+    var_set(a->v[i], len, a->v[i] + len + 1, 0);
+  }
+  last_status = 0;
+  return 1;
+}
+
+// Whether every word of `a` is a `NAME=value` assignment. Sets nothing.
+static int var_assignments_only(const args *restrict a)
+{
+  for (int i = 0; i < a->c; i++)
+  {
+    size_t len = var_name_len(a->v[i]);
+    if (!len || a->v[i][len] != '=')
+      return 0;
+  }
+  return 1;
+}
+
+// PATH changed: drops every directory and its watch, then builds the index from the new PATH.
+static void path_index_rebuild()
+{
+  for (size_t i = 0; i < watch.count; i++)
+    arena_destroy(&watch.dirs[i].names);
+  if (watch.fd != -1)
+    close(watch.fd);
+  free(watch.dirs);
+  free(watch.path);
+  // Hashed commands resolve again.
+  watch = (path_watch){.fd = -1, .generation = watch.generation + 1};
+  strings_release(&strings);
+  build_autocomplete_strings();
+}
+
+static const char* find_executable(const char *restrict target)
+{
+  uint64_t start = trace_begin();
+  strings_ready();
+  const char *path = command_hash_find(target);
+  trace_end("find_executable", start, target);
+  return path;
+}
+
+// Hashed path of `name` if its file is unchanged, else resolves it again and remembers the outcome.
+// Built-ins resolve to the index's "a shell builtin" and are never hashed.
+static const char* command_hash_find(const char *restrict name)
+{
+  hashed_command *e = command_hash_slot(name);
+  struct statx st;
+  if (e->name && e->generation == watch.generation)
+  {
+    if (!e->path && now_ns() < e->expires)
+      return NULL;
+    if (e->path && command_stat(e->path, &st) && st.stx_ino == e->ino && st.stx_mode == e->mode
+        && st.stx_mtime.tv_sec == e->mtime.tv_sec && st.stx_mtime.tv_nsec == e->mtime.tv_nsec)
+    {
+      e->hits++;
+      return e->path;
+    }
+  }
+  if (find_builtin(name) != -1)
+    return strings.strings + strings.offsets[strings.count + eytzinger_find(name)];
+  char buf[PATH_MAX];
+  const char *path = command_resolve(name, buf, &st);
+  // Inserting may grow the table.
+  if (!e->name)
+  {
+    if (!hashed.text.reserved)
+      arena_virtual_init(&hashed.text, COMMAND_HASH_TEXT_RESERVE);
+    size_t len = strlen(name) + 1;
+    char *copy = memcpy(arena_push(&hashed.text, alignof(char), len), name, len);
+    if (4 * (hashed.used + 1) > 3 * hashed.size)
+    {
+      hashed_command *old = hashed.slots;
+      uint32_t old_size = hashed.size;
+      hashed.size = MAX(2 * hashed.size, COMMAND_HASH_INITIAL_SIZE);
+      hashed.slots = calloc(hashed.size, sizeof(hashed_command));
+      assert(hashed.slots && "calloc failed.");
+      for (uint32_t i = 0; i < old_size; i++) if (old[i].name)
+        *command_hash_slot(old[i].name) = old[i];
+      free(old);
+    }
+    e = command_hash_slot(copy);
+    e->name = copy;
+    hashed.used++;
+  }
+  command_hash_store(e, path, &st);
+  if (path)
+    e->hits++;
+  return e->path;
+}
+
+// The slot holding `name`, or the free slot where it belongs. Never full: the table grows first.
+static hashed_command* command_hash_slot(const char *restrict name)
+{
+  static hashed_command none;
+  if (!hashed.size)
+    return memset(&none, 0, sizeof(none));
+  uint32_t mask = hashed.size - 1;
+  for (uint32_t i = hash_bytes(name, strlen(name)) & mask; ; i = (i + 1) & mask)
+  {
+    hashed_command *e = &hashed.slots[i];
+    if (!e->name || strcmp(e->name, name) == 0)
+      return e;
+  }
+}
+
+// Looks `name` up in the index, then checks the PATH directories one by one when the index
+// is stale or has nothing. Only `name`'s own candidates are stat'ed, nothing is rescanned.
+// `buf` (`PATH_MAX` bytes) holds a probed path; `st` describes the file found.
+static const char* command_resolve(const char *restrict name, char *restrict buf, struct statx *restrict st)
+{
+  int32_t idx = eytzinger_find(name);
+  if (idx != -1)
+  {
+    const char *path = strings.strings + strings.offsets[strings.count + idx];
+    if (command_stat(path, st))
+      return path;
+  }
+  if (strchr(name, '/'))
+    return NULL;
+  for (size_t i = 0; i < watch.count; i++)
+  {
+    if (!*watch.dirs[i].path || snprintf(buf, PATH_MAX, "%s/%s", watch.dirs[i].path, name) >= PATH_MAX)
+      continue;
+    if (command_stat(buf, st))
+      return buf;
+  }
+  return NULL;
+}
+
+// Whether `path` is an executable regular file, following links, filling `st` if so.
+static int command_stat(const char *restrict path, struct statx *restrict st)
+{
+  return statx(AT_FDCWD, path, 0, STATX_TYPE | STATX_MODE | STATX_INO | STATX_MTIME, st) == 0
+    && S_ISREG(st->stx_mode) && (st->stx_mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+}
+
+// Points `e` at `path` (copied), or makes it a negative entry when `path` is NULL.
+static void command_hash_store(hashed_command *restrict e, const char *restrict path, const struct statx *restrict st)
+{
+  e->generation = watch.generation;
+  if (!path)
+  {
+    e->path = NULL;
+    e->expires = now_ns() + COMMAND_HASH_NEGATIVE_TTL;
+    return;
+  }
+  if (!e->path || strcmp(e->path, path) != 0)
+  {
+    size_t len = strlen(path) + 1;
+    e->path = memcpy(arena_push(&hashed.text, alignof(char), len), path, len);
+  }
+  e->ino = st->stx_ino;
+  e->mtime = st->stx_mtime;
+  e->mode = st->stx_mode;
+}
+
+static void command_hash_clear()
+{
+  if (hashed.size)
+    memset(hashed.slots, 0, hashed.size * sizeof(hashed_command));
+  hashed.used = 0;
+  if (hashed.text.reserved)
+  {
+    arena_reset(&hashed.text);
+    arena_trim(&hashed.text, 0);
+  }
+}
+
+/* Single pass, table driven lexer. Words are unquoted in place: the write
+ * pointer `w` trails the read pointer `p`, and runs of plain or quoted bytes
+ * are found with `lex_scan` and moved in one go. A word may touch an operator
+ * (`a>b`, `a|b`): the operator is lexed before its first byte becomes the
+ * word's NUL terminator. A `$` parameter outside single quotes may outgrow
+ * the line, so its word moves to the end of `expansions` and is finished
+ * there. `$(...)` and backquotes run their command on the spot, see
+ * `lex_substitute`. Unquoted values are split on blanks, and an unquoted word
+ * that expands to nothing is dropped. A word with an unquoted *, ? or [ becomes a
+ * `GlobWord`, where a backslash keeps quoted metacharacters literal. */
+static const tokens* tokenize(char *restrict p, arena *restrict allocator)
+{
+  // Push a slice to the arena. Fill `tokens->v` by pushing tokens on the arena.
+  tokens *tks = ALLOCATOR_PUSH_TYPE(tokens);
+
+  size_t count = 0; // Keep count of tokens for `tokens->c`.
+  for (;;)
+  {
+    p = skip_spaces(p);
+    // Finished parsing
+    if (!*p)
+      break;
+
+    enum Token_Type t;
+    char *next = lex_operator(p, &t);
+    if (next != p)
+    {
+      ALLOCATOR_PUSH_TYPE(token)->t = t;
+      p = next;
+      count++;
+      continue;
+    }
+
+    // Word case
+    word_lexer x = {.start = p, .w = p};
+    for (;;)
+    {
+      // Plain run.
+      char *run = lex_scan(p, Class_Word);
+      lex_put(&x, p, run - p);
+      p = run;
+
+      enum Char_Class c = char_classes[(uint8_t)*p];
+      if (c == Class_Glob)
+      {
+        x.glob = 1;
+        lex_put(&x, p++, 1);
+      }
+      // Ignore everything inside single quotes.
+      else if (c == Class_Single_Quote)
+      {
+        p++;
+        x.quoted = 1;
+        for (;;)
+        {
+          char *stop = lex_scan(p, Class_Single_Quote);
+          assert(*stop && "unterminated single quotes");
+          lex_put(&x, p, stop - p);
+          p = stop + 1;
+          if (*stop == '\'')
+            break;
+          lex_literal(&x, *stop);
+        }
+      }
+      // Ignore _almost_ everything inside double quotes.
+      else if (c == Class_Double_Quote)
+      {
+        p++;
+        x.quoted = 1;
+        for (;;)
+        {
+          char *stop = lex_scan(p, Class_Double_Quote);
+          assert(*stop && "unterminated double quotes");
+          lex_put(&x, p, stop - p);
+          p = stop + 1;
+          if (*stop == '"')
+            break;
+          // Quoted: the value is taken whole and literally.
+          if (char_classes[(uint8_t)*stop] == Class_Dollar)
+          {
+            p = stop;
+            const char *value = lex_expansion(&x, &p);
+            if (value)
+              lex_value(&x, value);
+            else
+              lex_put(&x, "$", 1);
+            continue;
+          }
+          if (*stop != '\\')
+          {
+            lex_literal(&x, *stop);
+            continue;
+          }
+          // Backslash only escapes ", \, $, `, and newline.
+          switch (*p)
+          {
+            case '"':
+            case '\\':
+            case '$':
+            case '`':
+            case '\n':
+              lex_literal(&x, *p++);
+              break;
+            default:
+              assert(*p && "unterminated double quotes");
+              lex_literal(&x, '\\');
+              break;
+          }
+        }
+      }
+      // Escape any character.
+      else if (c == Class_Backslash)
+      {
+        assert(*(p + 1) && "escaped NUL terminator");
+        lex_literal(&x, *(p + 1));
+        p += 2;
+      }
+      else if (c == Class_Dollar)
+      {
+        const char *value = lex_expansion(&x, &p);
+        // The value of `NAME=...` is one word, as if quoted.
+        if (value && x.w > x.start && x.w[-1] == '=' && var_name_len(x.start) == (size_t)(x.w - x.start - 1))
+          lex_value(&x, value);
+        else if (value)
+          count += lex_split(&x, value, allocator);
+        else lex_put(&x, "$", 1);
+      }
+      // Base cases: exit when this token is over.
+      else break;
+    }
+
+    // Lex a touching operator before its first byte is overwritten.
+    enum Char_Class end = char_classes[(uint8_t)*p];
+    next = end == Class_Operator ? lex_operator(p, &t) : p + (end == Class_Space);
+    count += lex_finish(&x, allocator);
+    if (end == Class_Operator)
+    {
+      ALLOCATOR_PUSH_TYPE(token)->t = t;
+      count++;
+    }
+    p = next;
+  }
+  tks->c = count;
+  return tks;
+}
+
+// Moves the word to the end of `expansions`, where it can outgrow the line.
+static void lex_expand(word_lexer *restrict x)
+{
+  if (x->expanded)
+    return;
+  size_t n = x->w - x->start;
+  lex_room(expansions.data + expansions.len, n);
+  x->start = memcpy(expansions.data + expansions.len, x->start, n);
+  x->w = x->start + n;
+  x->expanded = 1;
+}
+
+// Appends `n` bytes from `s`, which may be the word's own line.
+static inline void lex_put(word_lexer *restrict x, const char *s, size_t n)
+{
+  if (x->expanded)
+    lex_room(x->w, n);
+  if (x->w != s)
+    memmove(x->w, s, n);
+  x->w += n;
+}
+
+// Appends a quoted or escaped byte. Glob metacharacters and backslashes get a backslash
+// of their own, which takes one byte more than the line has: the word moves to `expansions`.
+static inline void lex_literal(word_lexer *restrict x, char c)
+{
+  enum Char_Class class = char_classes[(uint8_t)c];
+  if (class != Class_Glob && class != Class_Backslash)
+  {
+    lex_put(x, &c, 1);
+    return;
+  }
+  lex_expand(x);
+  lex_room(x->w, 2);
+  *x->w++ = '\\';
+  *x->w++ = c;
+  x->escaped = 1;
+}
+
+// Appends an unquoted value: every run of blanks ends a word, and metacharacters stay
+// active. Returns the number of tokens pushed for the words it finished.
+static size_t lex_split(word_lexer *restrict x, const char *restrict v, arena *restrict allocator)
+{
+  size_t count = 0;
+  lex_expand(x);
+  for (; *v; v++)
+  {
+    if (*v == '\\')
+      lex_literal(x, *v);
+    else if (!is_whitespace(*v))
+    {
+      x->glob |= char_classes[(uint8_t)*v] == Class_Glob;
+      lex_put(x, v, 1);
+    }
+    else if (x->w != x->start || x->quoted)
+    {
+      count += lex_finish(x, allocator);
+      *x = (word_lexer){.start = x->w + 1, .w = x->w + 1, .expanded = 1};
+    }
+  }
+  return count;
+}
+
+// Appends a quoted value, keeping its metacharacters literal.
+static void lex_value(word_lexer *restrict x, const char *restrict v)
+{
+  lex_expand(x);
+  for (;;)
+  {
+    size_t n = strcspn(v, "*?[\\");
+    lex_put(x, v, n);
+    v += n;
+    if (!*v)
+      return;
+    lex_literal(x, *v++);
+  }
+}
+
+// NUL-terminates the word and pushes its token, unless it is unquoted and empty. Returns
+// the number of tokens pushed. Escapes are only kept for `GlobWord`s.
+static inline int lex_finish(word_lexer *restrict x, arena *restrict allocator)
+{
+  if (x->expanded)
+    lex_room(x->w, 1);
+  *x->w = '\0';
+  if (x->escaped && !x->glob)
+    x->w = glob_unescape(x->start);
+  if (x->expanded)
+    expansions.len = x->w + 1 - expansions.data;
+  if (x->w == x->start && !x->quoted)
+    return 0;
+  ALLOCATOR_PUSH_TYPE(token)->ptr = CHAR_PTR_TO_TOKEN(x->start) | (x->glob ? GlobWord : Word);
+  return 1;
+}
+
+// Lexes the operator at `p` into `t`. Returns the byte after it, or `p` when there is none.
+// `1>` and `2>` only count at the start of a token.
+static char* lex_operator(char *restrict p, enum Token_Type *restrict t)
+{
+  char c = *p;
+  // Multiple commands case
+  if (c == '|')
+  {
+    *t = Pipe;
+    return p + 1;
+  }
+  if (c == '&')
+  {
+    // Sequential
+    if (*(p+1) == '&')
+    {
+      *t = Sequential;
+      return p + 2;
+    }
+    *t = Background;
+    return p + 1;
+  }
+  // Redirect stdout case
+  if ((c == '>') || ((c == '1') && (*(p+1) == '>') && p++))
+  {
+    // Append case
+    if (*(p+1) == '>')
+    {
+      *t = AppendOut;
+      return p + 2;
+    }
+    *t = RedirectOut;
+    return p + 1;
+  }
+  // Redirect stderr case
+  if ((c == '2') && (*(p+1) == '>'))
+  {
+    // Append case
+    if (*(p+2) == '>')
+    {
+      *t = AppendErr;
+      return p + 3;
+    }
+    *t = RedirectErr;
+    return p + 2;
+  }
+  return p;
+}
+
+/* Returns the first byte from `p` on that ends a run of the given kind:
+ * `Class_Word`: anything not `Class_Word`;
+ * `Class_Single_Quote`: ', NUL, a glob metacharacter or \;
+ * `Class_Double_Quote`: ", \, $, `, NUL or a glob metacharacter.
+ * Quoted metacharacters and backslashes stop the scan so `lex_literal` can escape them.
+ * The SSE2 path tests 16 bytes per step. Its loads are 16-byte aligned, so they
+ * never cross into the next page even when they read past the NUL. Stops other
+ * than |, >, \, ?, [ and ` all sort at or below *, so every kind tests that range and
+ * rules out the bytes it also catches (blanks, controls, !, #, %, parentheses). */
+static char* lex_scan(char *restrict p, enum Char_Class stop)
+{
+  const unsigned stops = stop == Class_Word ? ~(1u << Class_Word)
+    : 1u << stop | 1u << Class_End | 1u << Class_Backslash | 1u << Class_Glob | (stop == Class_Double_Quote) << Class_Dollar;
+#ifdef __SSE2__
+  const __m128i low_top = _mm_set1_epi8('*'), zero = _mm_setzero_si128();
+  const __m128i backslash = _mm_set1_epi8('\\'), question = _mm_set1_epi8('?'), bracket = _mm_set1_epi8('[');
+  const __m128i backquote = _mm_set1_epi8('`'), pipe = _mm_set1_epi8('|'), greater = _mm_set1_epi8('>');
+  uintptr_t misalignment = (uintptr_t)p & 15;
+  const __m128i *block = (const __m128i*)(p - misalignment);
+  // Bytes before `p` in the first block do not count.
+  unsigned ignore = ~0u << misalignment;
+  for (;; block++, ignore = ~0u)
+  {
+    __m128i bytes = _mm_load_si128(block);
+    __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(_mm_subs_epu8(bytes, low_top), zero),
+      _mm_or_si128(_mm_cmpeq_epi8(bytes, backslash), _mm_or_si128(_mm_cmpeq_epi8(bytes, question), _mm_cmpeq_epi8(bytes, bracket))));
+    if (stop != Class_Single_Quote)
+      hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, backquote));
+    if (stop == Class_Word)
+      hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(bytes, pipe), _mm_cmpeq_epi8(bytes, greater)));
+    unsigned mask = (unsigned)_mm_movemask_epi8(hits) & ignore;
+    for (; mask; mask &= mask - 1)
+    {
+      char *c = (char*)block + __builtin_ctz(mask);
+      if (stops >> char_classes[(uint8_t)*c] & 1)
+        return c;
+    }
+  }
+#else
+  while (!(stops >> char_classes[(uint8_t)*p] & 1))
+    p++;
+  return p;
+#endif
+}
+
+// Value of the parameter named at `*p`, just past a `$`: `$NAME`, `${NAME}` or `$?`.
+// Moves `*p` past it. Unset variables are "". NULL when no name follows: the `$` is literal.
+static const char* lex_parameter(char *restrict *p)
+{
+  static char status[16];
+  char *name = *p;
+  int braced = *name == '{';
+  name += braced;
+  size_t len = *name == '?' ? 1 : var_name_len(name);
+  if (!len || (braced && name[len] != '}'))
+    return NULL;
+  *p = name + len + braced;
+  if (*name == '?')
+  {
+    snprintf(status, sizeof(status), "%d", last_status);
+    return status;
+  }
+  const char *value = var_lookup(name, len);
+  return value ? value : "";
+}
+
+// Value of the expansion at `*p`, a `$` or a backquote, and moves `*p` past it.
+// NULL when the `$` is literal. Command substitutions run right here, see `lex_substitute`.
+static const char* lex_expansion(word_lexer *restrict x, char *restrict *p)
+{
+  char *s = *p, *close;
+  if (*s == '`')
+  {
+    // Inside backquotes, a backslash only escapes `, \ and $.
+    char *w = ++s;
+    for (close = s; *close != '`'; close++)
+    {
+      assert(*close && "unterminated backquote");
+      if (*close == '\\' && (close[1] == '`' || close[1] == '\\' || close[1] == '$'))
+        close++;
+      *w++ = *close;
+    }
+    *w = '\0';
+    *p = close + 1;
+    return lex_substitute(x, s);
+  }
+  if (s[1] == '(')
+  {
+    close = lex_substitution_end(s + 2);
+    assert(close && "unterminated $(");
+    *close = '\0';
+    *p = close + 1;
+    return lex_substitute(x, s + 2);
+  }
+  *p = s + 1;
+  return lex_parameter(p);
+}
+
+// The `)` closing a `$(` whose text starts at `p`, skipping quoted and escaped parentheses. NULL if none.
+static char* lex_substitution_end(char *restrict p)
+{
+  for (int depth = 1; *p; p++)
+  {
+    if (*p == '\\' && p[1])
+      p++;
+    else if (*p == '\'' || *p == '"' || *p == '`')
+    {
+      char quote = *p;
+      while (*++p != quote)
+      {
+        if (!*p)
+          return NULL;
+        if (quote != '\'' && *p == '\\' && p[1])
+          p++;
       }
-      ALLOCATOR_PUSH_TYPE(token)->ptr = CHAR_PTR_TO_TOKEN(start);
     }
-    count++;
+    else if (*p == '(')
+      depth++;
+    else if (*p == ')' && !--depth)
+      return p;
   }
-  tks->c = count;
-  return tks;
+  return NULL;
+}
+
+/* Runs `inner`, the text of a `$(...)` or of backquotes, and returns its stdout without
+ * trailing newlines. The inner line is tokenized and parsed into `substitutions`, its words
+ * built in `expansions` past the word `x` being lexed. Both are dead once it ran, so both
+ * lengths are put back: an enclosing inner line keeps pushing its tokens contiguously.
+ * The output is copied ahead of `x->w` instead, see below. */
+static const char* lex_substitute(word_lexer *restrict x, char *restrict inner)
+{
+  if (*skip_spaces(inner) == '\0')
+    return "";
+  uint64_t start = trace_begin();
+  lex_expand(x);
+  size_t words = expansions.len, mark = substitutions.len;
+  expansions.len = x->w - expansions.data;
+  const commands *cmds = parse(tokenize(inner, &substitutions), &substitutions);
+  size_t output = substitutions.len;
+  substitution_run(cmds);
+  char *value = substitutions.data + output;
+  size_t len = substitutions.len - output;
+  while (len && value[len - 1] == '\n')
+    len--;
+  // The caller writes the word on from `x->w` while reading the value, at most two bytes
+  // per byte read (escapes), so a copy `len + 1` bytes ahead is never overtaken.
+  lex_room(x->w, 2 * len + 2);
+  char *copy = memcpy(x->w + len + 1, value, len);
+  copy[len] = '\0';
+  trace_end("substitution", start, cmds->c ? cmds->v[0].v[0] : NULL);
+  expansions.len = words;
+  substitutions.len = mark;
+  return copy;
+}
+
+/* Runs `cmds` with stdout appended to `substitutions`. A lone builtin that leaves the shell
+ * alone runs in this process, its output captured straight from `out`. A lone executable is
+ * spawned with stdout on a pipe. Anything else runs in a forked subshell, so `cd`, `exit`
+ * and assignments inside do not reach this shell. */
+static void substitution_run(const commands *restrict cmds)
+{
+  const args *a = cmds->v;
+  int single = cmds->c == 1 && a->link == Sequential && !a->timed;
+  int builtin = single ? find_builtin(a->v[0]) : -1;
+  if (builtin != -1 && !builtin_needs_child[builtin] && a->redirection.t == Word)
+  {
+    // Its scratch goes past the inner words in `expansions`, out of the output's way.
+    out_capture = &substitutions;
+    run_builtin(builtin, a, &expansions);
+    out_capture = NULL;
+    return;
+  }
+
+  int fds[2];
+  if (pipe_open(fds) == -1)
+  {
+    fprintf(stderr, "lush: $(...): %s\n", strerror(errno));
+    last_status = 1;
+    return;
+  }
+  pid_t pid = -1;
+  int spawn_status = 127;
+  if (single && builtin == -1 && !var_assignments_only(a))
+  {
+    const char *full_path = find_executable(a->v[0]);
+    spawn_fds spawned = {.in = -1, .out = fds[1], .redirection = a->redirection};
+    if (full_path)
+    {
+      pid = spawn_command(full_path, a->v, &spawned);
+      spawn_status = spawned.status;
+    }
+    else fprintf(stderr, "%s: command not found\n", a->v[0]);
+  }
+  else
+  {
+    uint64_t fork_start = trace_begin();
+    pid = fork();
+    assert((pid != -1) && "`fork` failed for $(...).");
+    if (pid == 0)
+    {
+      dup2(fds[1], STDOUT_FILENO);
+      // An `exit` in here must not append this session's history a second time.
+      session_command_count = 0;
+      execute_commands(cmds, &expansions);
+      _exit(last_status);
+    }
+    trace_end("fork", fork_start, a->v[0]);
+  }
+  close(fds[1]);
+  substitution_read(fds[0]);
+  close(fds[0]);
+  last_status = spawn_status;
+  int wstat;
+  if (pid != -1 && waitpid(pid, &wstat, 0) == pid)
+    last_status = wait_status(wstat);
+}
+
+// Reads `fd` to its end onto `substitutions`.
+static void substitution_read(int fd)
+{
+  for (;;)
+  {
+    char *buf = arena_push(&substitutions, alignof(char), SUBSTITUTION_READ_SIZE);
+    ssize_t n = read(fd, buf, SUBSTITUTION_READ_SIZE);
+    substitutions.len -= SUBSTITUTION_READ_SIZE - (n > 0 ? n : 0);
+    if (n == 0 || (n < 0 && errno != EINTR))
+      return;
+  }
+}
+
+// Commits `expansions` so `n` more bytes fit at `w`, the end of the word being built there.
+// Its `len` is only moved past a word once the word is finished.
+static void lex_room(const char *restrict w, size_t n)
+{
+  size_t end = w + n - expansions.data;
+  if (end > expansions.capacity)
+    arena_commit(&expansions, end);
 }
 
 static const commands *parse(const tokens *restrict T, arena *restrict allocator)
@@ -715,175 +3691,767 @@ static const commands *parse(const tokens *restrict T, arena *restrict allocator
   commands *cmds = ALLOCATOR_PUSH_TYPE(commands);
   args *a = ALLOCATOR_PUSH_TYPE(args);
   a->redirection.t = Word;
+  a->timed = 0;
+
+  int i = 0, argc = 0, cmdc = 0, end = T->c;
+  enum Token_Type last_link = Sequential;
+  while (i < end) {
+    token t = T->v[i++];
+    if (IS_WORD_TOKEN(t))
+    {
+      // `time` prefixing a pipeline is a keyword: it marks the pipeline instead of running.
+      if (argc == 0 && last_link != Pipe && !a->timed && i < end && IS_WORD_TOKEN(T->v[i])
+          && strcmp(EXTRACT_TOKEN_PTR(t), "time") == 0)
+      {
+        a->timed = 1;
+        continue;
+      }
+      // Every match is an argument. Without any, the pattern itself is.
+      if (EXTRACT_TOKEN_TYPE(t) == GlobWord)
+      {
+        size_t matches = glob_expand(EXTRACT_TOKEN_PTR(t), allocator);
+        argc += matches;
+        if (matches)
+          continue;
+        glob_unescape(EXTRACT_TOKEN_PTR(t));
+      }
+      // Fill `args->v` by pushing words to the arena.
+      *ALLOCATOR_PUSH_TYPE(char*) = EXTRACT_TOKEN_PTR(t);
+      argc++;
+    }
+    // Redirections:
+    else if (t.t <= AppendErr)
+    {
+      assert(t.t < Token_Type_Size && "This token should not have an embedded pointer.");
+      if (i == end || !IS_WORD_TOKEN(T->v[i]))
+        return parse_redirect_error(cmds);
+      // Redirection targets are not expanded.
+      token target = T->v[i++];
+      if (EXTRACT_TOKEN_TYPE(target) == GlobWord)
+        glob_unescape(EXTRACT_TOKEN_PTR(target));
+      a->redirection.ptr = (target.ptr & ~(intptr_t)TOKEN_TYPE_MASK) | t.t;
+    }
+    else // Split command
+    {
+      if (argc == 0)
+        return parse_error(cmds, t.t);
+      a->c = argc;
+      a->link = last_link = t.t;
+      *ALLOCATOR_PUSH_TYPE(char*) = NULL; // Null-terminated `args->v`.
+      argc = 0;
+      cmdc++;
+      a = ALLOCATOR_PUSH_TYPE(args);
+      a->redirection.t = Word;
+      a->timed = 0;
+    }
+  }
+  // A trailing & ends its command by itself. No words at all, e.g. only `$UNSET`, is an empty line.
+  if (argc == 0 && (last_link == Background || cmdc == 0))
+  {
+    cmds->c = cmdc;
+    return cmds;
+  }
+  if (argc == 0)
+    return parse_error(cmds, last_link);
+  a->c = argc;
+  a->link = Sequential;
+  *ALLOCATOR_PUSH_TYPE(char*) = NULL; // Null-terminated `args->v`.
+  cmds->c = cmdc + 1;
+
+  return cmds;
+}
+
+// Reports a `link` with no command on one of its sides. The line runs as empty.
+static const commands *parse_error(commands *restrict cmds, enum Token_Type link)
+{
+  fprintf(stderr, "lush: syntax error near `%s'\n", link == Pipe ? "|" : link == Background ? "&" : "&&");
+  last_status = 2;
+  cmds->c = 0;
+  return cmds;
+}
+
+// Reports a redirection without a target word, e.g. `> $UNSET`. The line runs as empty.
+// An expansion to nothing leaves no token behind, so it cannot be told from a missing word.
+static const commands *parse_redirect_error(commands *restrict cmds)
+{
+  fprintf(stderr, "lush: ambiguous redirect\n");
+  last_status = 1;
+  cmds->c = 0;
+  return cmds;
+}
+
+// Drops the backslashes `lex_literal` put before literal bytes. Returns the new end of `s`.
+static char* glob_unescape(char *restrict s)
+{
+  char *w = s;
+  for (; *s; s++)
+  {
+    if (*s == '\\')
+      s++;
+    *w++ = *s;
+  }
+  *w = '\0';
+  return w;
+}
+
+/* Expands `pattern`, a `GlobWord`: pushes a pointer per matching path onto `allocator`,
+ * in the order of the executable index, and the paths themselves onto `expansions`.
+ * Components are compiled once, every directory on the way is read once with `getdents64`,
+ * and components without metacharacters are appended without reading anything.
+ * Returns the number of matches. */
+static size_t glob_expand(char *restrict pattern, arena *restrict allocator)
+{
+  uint64_t start = trace_begin();
+  glob_state *g = &globber;
+  if (!g->scratch.reserved)
+    arena_virtual_init(&g->scratch, PATH_DIR_ARENA_RESERVE);
+  g->buf = arena_push(&g->scratch, alignof(struct dirent64), GETDENTS_BUFFER_SIZE);
+
+  size_t len = strlen(pattern);
+  g->dirs_only = 0;
+  for (; len > 1 && pattern[len - 1] == '/'; len--)
+    g->dirs_only = 1;
+  size_t root = *pattern == '/';
+  g->components = arena_push(&g->scratch, alignof(glob_component), (len / 2 + 1) * sizeof(glob_component));
+  g->count = 0;
+  for (const char *s = pattern + root, *end; s < pattern + len; s = end + 1)
+  {
+    end = memchr(s, '/', pattern + len - s);
+    if (!end)
+      end = pattern + len;
+    if (end != s)
+      glob_compile(&g->components[g->count++], s, end - s, &g->scratch);
+  }
+
+  g->path[0] = '/';
+  g->allocator = allocator;
+  g->matches = 0;
+  if (g->count)
+    glob_walk(g, root, 0);
+
+  arena_reset(&g->scratch);
+  arena_trim(&g->scratch, GETDENTS_BUFFER_SIZE + ARENA_DEFAULT_SIZE);
+  trace_end("glob_expand", start, pattern);
+  return g->matches;
+}
+
+// Compiles the component `s[0..n)`, still carrying `lex_literal`'s escapes.
+static void glob_compile(glob_component *restrict c, const char *restrict s, size_t n, arena *restrict scratch)
+{
+  glob_op *ops = arena_push(scratch, alignof(glob_op), n * sizeof(glob_op));
+  char *text = arena_push(scratch, alignof(char), n); // Unescaped literal bytes.
+  uint32_t count = 0;
+  const char *end = s + n;
+  while (s < end)
+  {
+    char ch = *s++;
+    if (ch == '*')
+    {
+      // Adjacent stars are one.
+      if (!count || ops[count - 1].op != Glob_Star)
+        ops[count++] = (glob_op){.op = Glob_Star};
+      continue;
+    }
+    if (ch == '?')
+    {
+      ops[count++] = (glob_op){.op = Glob_Any};
+      continue;
+    }
+    if (ch == '[')
+    {
+      glob_op op = {.op = Glob_Class};
+      const char *q = s;
+      int negate = q < end && (*q == '!' || *q == '^');
+      q += negate;
+      // A ']' right after the bracket is a member.
+      for (int first = 1; q < end && (*q != ']' || first); first = 0)
+      {
+        uint8_t lo = *q++;
+        if (lo == '\\' && q < end)
+          lo = *q++;
+        uint8_t hi = lo;
+        if (q + 1 < end && *q == '-' && q[1] != ']')
+        {
+          hi = *++q;
+          q++;
+          if (hi == '\\' && q < end)
+            hi = *q++;
+        }
+        for (unsigned b = lo; b <= hi; b++)
+          op.set[b >> 6] |= 1ull << (b & 63);
+      }
+      if (q < end)
+      {
+        if (negate)
+          for (int i = 0; i < 4; i++)
+            op.set[i] = ~op.set[i];
+        ops[count++] = op;
+        s = q + 1;
+        continue;
+      }
+      // Never closed: the bracket is literal.
+    }
+    else if (ch == '\\')
+      ch = *s++;
+    if (!count || ops[count - 1].op != Glob_Literal)
+      ops[count++] = (glob_op){.op = Glob_Literal, .literal = text};
+    *text++ = ch;
+    ops[count - 1].len++;
+  }
+  assert(count && "Empty path component.");
+  c->ops = ops;
+  c->count = count;
+  c->literal = count == 1 && ops[0].op == Glob_Literal;
+  c->dot = ops[0].op == Glob_Literal && ops[0].literal[0] == '.';
+  int tail = count > 1 && ops[count - 1].op == Glob_Literal;
+  c->suffix = tail ? ops[count - 1].literal : NULL;
+  c->suffix_len = tail ? ops[count - 1].len : 0;
+}
+
+/* Whether `name` matches the component. A mismatch only backtracks to the last *,
+ * which then swallows one more byte (skipping straight to the next byte that can start
+ * the literal after it), so a name costs O(len * ops) at worst and O(len) in practice. */
+static int glob_match(const glob_component *restrict c, const char *restrict name, size_t len)
+{
+  if (len < c->suffix_len || memcmp(name + len - c->suffix_len, c->suffix, c->suffix_len) != 0)
+    return 0;
+  const char *s = name, *end = name + len, *resume = NULL;
+  uint32_t i = 0, star = UINT32_MAX;
+  while (i < c->count || s < end)
+  {
+    if (i < c->count)
+    {
+      const glob_op *op = &c->ops[i];
+      if (op->op == Glob_Star)
+      {
+        if (i + 1 == c->count)
+          return 1;
+        star = i++;
+        resume = s;
+        continue;
+      }
+      if (op->op == Glob_Literal ? (size_t)(end - s) >= op->len && memcmp(s, op->literal, op->len) == 0
+          : s < end && (op->op == Glob_Any || (op->set[(uint8_t)*s >> 6] >> ((uint8_t)*s & 63) & 1)))
+      {
+        s += op->op == Glob_Literal ? op->len : 1;
+        i++;
+        continue;
+      }
+    }
+    if (star == UINT32_MAX || resume == end)
+      return 0;
+    resume++;
+    const glob_op *next = &c->ops[star + 1];
+    if (next->op == Glob_Literal && !(resume = memchr(resume, next->literal[0], end - resume)))
+      return 0;
+    s = resume;
+    i = star + 1;
+  }
+  return 1;
+}
+
+// Copies `g->path[0..len)` to `expansions` as a match.
+static void glob_push(glob_state *restrict g, size_t len)
+{
+  size_t n = len + g->dirs_only;
+  char *match = arena_push(&expansions, alignof(char), n + 1);
+  memcpy(match, g->path, len);
+  if (g->dirs_only)
+    match[len] = '/';
+  match[n] = '\0';
+  *ARENA_PUSH_TYPE(g->allocator, char*) = match;
+  g->matches++;
+}
+
+// Matches component `k` in the directory `g->path[0..len)` (the cwd when empty), then pushes
+// the matches or descends into them. The directory is read fully before recursing, since
+// deeper levels reuse `g->buf`. Names starting with '.' only match a component that does.
+static void glob_walk(glob_state *restrict g, size_t len, uint32_t k)
+{
+  const glob_component *c = &g->components[k];
+  int last = k + 1 == g->count;
+  struct stat st;
+  if (c->literal)
+  {
+    size_t n = c->ops[0].len;
+    if (len + n + 2 > PATH_MAX)
+      return;
+    memcpy(g->path + len, c->ops[0].literal, n);
+    g->path[len + n] = '\0';
+    if (!last)
+    {
+      g->path[len + n] = '/';
+      glob_walk(g, len + n + 1, k + 1);
+    }
+    else if (g->dirs_only ? stat(g->path, &st) == 0 && S_ISDIR(st.st_mode) : lstat(g->path, &st) == 0)
+      glob_push(g, len + n);
+    return;
+  }
+
+  g->path[len] = '\0';
+  int dfd = open(len ? g->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd == -1)
+    return;
+  // Matching names, back to back in `g->scratch`.
+  const char *names = NULL;
+  size_t count = 0;
+  ssize_t n;
+  while ((n = getdents64(dfd, g->buf, GETDENTS_BUFFER_SIZE)) > 0)
+    for (char *p = g->buf; p < g->buf + n; p += ((struct dirent64*)p)->d_reclen)
+    {
+      const struct dirent64 *d = (const struct dirent64*)p;
+      const char *name = d->d_name;
+      if (*name == '.' && (!c->dot || !name[1] || (name[1] == '.' && !name[2])))
+        continue;
+      size_t name_len = strlen(name);
+      if (!glob_match(c, name, name_len))
+        continue;
+      // Inner components and a trailing '/' only match directories.
+      if ((!last || g->dirs_only) && d->d_type != DT_DIR
+          && ((d->d_type != DT_LNK && d->d_type != DT_UNKNOWN) || fstatat(dfd, name, &st, 0) != 0 || !S_ISDIR(st.st_mode)))
+        continue;
+      char *copy = memcpy(arena_push(&g->scratch, alignof(char), name_len + 1), name, name_len + 1);
+      if (!count++)
+        names = copy;
+    }
+  close(dfd);
+  if (!count)
+    return;
+
+  // Same sort as the PATH index.
+  temp_entry *entries = arena_push(&g->scratch, alignof(temp_entry), 2 * count * sizeof(temp_entry));
+  const char *name = names;
+  for (size_t i = 0; i < count; i++, name += strlen(name) + 1)
+    entries[i] = (temp_entry){.name = name};
+  temp_entry_radix_sort(entries, entries + count, count, 0);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    size_t n = strlen(entries[i].name);
+    if (len + n + 2 > PATH_MAX)
+      continue;
+    memcpy(g->path + len, entries[i].name, n);
+    if (last)
+      glob_push(g, len + n);
+    else
+    {
+      g->path[len + n] = '/';
+      glob_walk(g, len + n + 1, k + 1);
+    }
+  }
+}
+
+// Removes whitespace (' ', '\n', '\t')
+static char* skip_spaces(char *restrict p)
+{
+  while (is_whitespace(*p++));
+  return p - 1;
+}
+
+static int is_whitespace(char c)
+{
+  return char_classes[(uint8_t)c] == Class_Space;
+}
+
+static int is_decimal_num(const char *restrict c)
+{
+  char d;
+  if (*c == '-')
+    c++;
+  while ((d = *c++))
+    if (d < '0' || d > '9')
+      return 0;
+  return 1;
+}
+
+// Waits for the first index build and applies pending PATH changes.
+static void strings_ready()
+{
+  // Blocks while the background build runs.
+  uint64_t start = trace_begin();
+  pthread_once(&strings_once, build_autocomplete_strings);
+  trace_end("strings_ready", start, NULL);
+  path_watch_poll();
+}
+
+// Returns the trie node whose range is exactly the names starting with `prefix`, or -1.
+// Walks at most `len` bytes of edge labels plus one label scan per level.
+static int32_t trie_find(const char *restrict prefix, size_t len)
+{
+  if (!trie.count)
+    return -1;
+  uint32_t n = 0, depth = 0;
+  for (;;)
+  {
+    const trie_node *node = &trie.nodes[n];
+    const char *name = strings.strings + strings.offsets[node->lo];
+    size_t end = MIN(node->depth, len);
+    if (memcmp(prefix + depth, name + depth, end - depth) != 0)
+      return -1;
+    if (len <= node->depth)
+      return n;
+    uint8_t b = prefix[node->depth];
+    const uint8_t *labels = trie.labels + node->first_child;
+    uint32_t i = 0;
+    while (i < node->child_count && labels[i] < b)
+      i++;
+    if (i == node->child_count || labels[i] != b)
+      return -1;
+    depth = node->depth;
+    n = node->first_child + i;
+  }
+}
+
+static void* init_once(void *_)
+{
+  pthread_once(&strings_once, build_autocomplete_strings);
+  return 0;
+}
+
+// Rebuilds the lookup structures derived from `strings`.
+static void strings_derive()
+{
+  trie_build();
+  eytzinger_build();
+}
+
+// Rebuilds `trie` over the current `strings`. At most 2 * count nodes: every inner node branches.
+static void trie_build()
+{
+  free(trie.nodes);
+  free(trie.labels);
+  trie = (strings_trie){0};
+  if (!strings.count)
+    return;
+  trie.nodes = malloc(2 * (size_t)strings.count * sizeof(trie_node));
+  trie.labels = malloc(2 * (size_t)strings.count);
+  assert(trie.nodes && trie.labels && "malloc failed.");
+  trie.count = 1;
+  trie.labels[0] = 0;
+  trie_build_node(0, 0, strings.count);
+}
+
+// Fills node `n` for names [lo, hi) and, recursively, its children.
+static uint32_t trie_build_node(uint32_t n, uint32_t lo, uint32_t hi)
+{
+  const char *first = strings.strings + strings.offsets[lo];
+  const char *last = strings.strings + strings.offsets[hi - 1];
+  // Sorted range: the first and last names bound the common prefix.
+  uint32_t depth = 0;
+  while (first[depth] && first[depth] == last[depth])
+    depth++;
+
+  trie_node *node = &trie.nodes[n];
+  *node = (trie_node){.lo = lo, .hi = hi, .depth = depth};
+  if (hi - lo == 1)
+    return n;
+
+  // One child per distinct byte at `depth`. Reserve them contiguously before recursing.
+  uint32_t groups = 0;
+  for (uint32_t i = lo; i < hi; groups++)
+  {
+    uint8_t b = strings.strings[strings.offsets[i] + depth];
+    while (i < hi && (uint8_t)strings.strings[strings.offsets[i] + depth] == b)
+      i++;
+  }
+  node->first_child = trie.count;
+  node->child_count = groups;
+  trie.count += groups;
+
+  uint32_t child = node->first_child;
+  for (uint32_t i = lo; i < hi; child++)
+  {
+    uint32_t start = i;
+    uint8_t b = strings.strings[strings.offsets[i] + depth];
+    while (i < hi && (uint8_t)strings.strings[strings.offsets[i] + depth] == b)
+      i++;
+    trie.labels[child] = b;
+    trie_build_node(child, start, i);
+  }
+  return n;
+}
+
+static void eytzinger_build()
+{
+  free(eytzinger.keys);
+  free(eytzinger.idx);
+  eytzinger.count = strings.count;
+  eytzinger.keys = malloc(((size_t)strings.count + 1) * sizeof(prefix_key));
+  eytzinger.idx = malloc(((size_t)strings.count + 1) * sizeof(uint32_t));
+  assert(eytzinger.keys && eytzinger.idx && "malloc failed.");
+  eytzinger.keys[0] = (prefix_key){0};
+  eytzinger.idx[0] = 0;
+  eytzinger_fill(0, 1);
+}
+
+// In-order walk of the implicit tree rooted at `k`, handing out sorted indexes from `i`.
+static uint32_t eytzinger_fill(uint32_t i, uint32_t k)
+{
+  if (k <= eytzinger.count)
+  {
+    i = eytzinger_fill(i, 2 * k);
+    eytzinger.keys[k] = prefix_key_of(strings.strings + strings.offsets[i]);
+    eytzinger.idx[k] = i++;
+    i = eytzinger_fill(i, 2 * k + 1);
+  }
+  return i;
+}
+
+// Returns the sorted index of `target` in `strings`, or -1.
+// Branchless descent over `keys`, 16-byte keys compared as two big-endian words (`hi`, then `lo`);
+// only a tie on all 16 key bytes compares the rest of the strings.
+static int32_t eytzinger_find(const char *restrict target)
+{
+  prefix_key t = prefix_key_of(target);
+  // A NUL in the key means the whole name is in it: equal keys are equal names.
+  int long_target = (t.lo & 0xff) != 0;
+  uint32_t k = 1, n = eytzinger.count;
+  while (k <= n)
+  {
+    // Three levels down share two cache lines of keys.
+    __builtin_prefetch(eytzinger.keys + 8 * (size_t)k);
+    prefix_key key = eytzinger.keys[k];
+    int less = key.hi < t.hi || (key.hi == t.hi && (key.lo < t.lo || (key.lo == t.lo && long_target &&
+      strcmp(strings.strings + strings.offsets[eytzinger.idx[k]] + 16, target + 16) < 0)));
+    k = 2 * k + less;
+  }
+  // Undo the final right turns: `k` becomes the lower bound, 0 when past the end.
+  k >>= __builtin_ffs(~k);
+  if (k == 0 || eytzinger.keys[k].hi != t.hi || eytzinger.keys[k].lo != t.lo)
+    return -1;
+  uint32_t idx = eytzinger.idx[k];
+  if (long_target && strcmp(strings.strings + strings.offsets[idx] + 16, target + 16) != 0)
+    return -1;
+  return idx;
+}
+
+static prefix_key prefix_key_of(const char *restrict s)
+{
+  prefix_key key = {0};
+  int i = 0;
+  for (; i < 8 && s[i]; i++)
+    key.hi |= (uint64_t)(uint8_t)s[i] << (56 - 8 * i);
+  if (i == 8)
+    for (; i < 16 && s[i]; i++)
+      key.lo |= (uint64_t)(uint8_t)s[i] << (120 - 8 * i);
+  return key;
+}
+
+static void build_autocomplete_strings()
+{
+  /******************************************************
+   * Split PATH into directories and watch them.
+   ******************************************************/
+  index_timing = var_get("LUSH_TIMING") != NULL;
+  uint64_t build_start = trace_begin();
+  const char *PATH = var_get("PATH");
+  if (PATH)
+  {
+    // PATH is immutable, so make a mutable copy.
+    watch.path = strdup(PATH);
+    assert(watch.path && "strdup failed.");
+    size_t count = 1;
+    for (const char *c = watch.path; *c; c++)
+      count += *c == PATH_LIST_SEPARATOR[0];
+    watch.dirs = calloc(count, sizeof(path_dir));
+    assert(watch.dirs && "calloc failed.");
 
-  int i = 0, argc = 0, cmdc = 0, end = T->c;
-  while (i < end) {
-    token t = T->v[i++];
-    if (EXTRACT_TOKEN_TYPE(t) == Word)
-    {
-      // Fill `args->v` by pushing words to the arena.
-      *ALLOCATOR_PUSH_TYPE(char*) = EXTRACT_TOKEN_PTR(t);
-      argc++;
-    }
-    // Redirections:
-    else if (t.t <= AppendErr)
-    {
-      assert(t.t < Token_Type_Size && "This token should not have an embedded pointer.");
-      assert(i < end && "Syntax error: redirected without a target.");
-      assert(EXTRACT_TOKEN_TYPE(T->v[i]) == Word && "Syntax error: did not redirect to a file.");
-      assert(Word == 0 && "This assumes `Word` to be zero. Otherwise, `T->v[i].ptr` would need to be masked.");
-      a->redirection.ptr = T->v[i++].ptr | t.t;
-    }
-    else // Split command
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    char *path = watch.path, *dir;
+    while ((dir = strsep(&path, PATH_LIST_SEPARATOR)))
     {
-      // FIXME: this does not allow ending a line in & for background tasks.
-      assert(argc && "Syntax error: used | or && without a command on left side.");
-      a->c = argc;
-      if (t.t == Pipe) // Do not add redirection for &&
-        a->redirection.t = Pipe; // Pipes don't need a pointer to their destination.
-      *ALLOCATOR_PUSH_TYPE(char*) = NULL; // Null-terminated `args->v`.
-      argc = 0;
-      cmdc++;
-      a = ALLOCATOR_PUSH_TYPE(args);
-      a->redirection.t = Word;
+      path_dir *d = &watch.dirs[watch.count++];
+      d->path = dir;
+      d->wd = watch.fd == -1 ? -1 : inotify_add_watch(watch.fd, dir, INOTIFY_MASK | IN_ONLYDIR);
+      arena_virtual_init(&d->names, PATH_DIR_ARENA_RESERVE);
+      d->dirty = 1;
     }
   }
-  assert(argc > 0 && "Ended a line with a && or | to nowhere.");
-  a->c = argc;
-  *ALLOCATOR_PUSH_TYPE(char*) = NULL; // Null-terminated `args->v`.
-  cmds->c = cmdc + 1;
 
-  return cmds;
-}
+  // A valid cache also restores every directory's names, so an inotify event rescans only its own.
+  uint64_t load_start = trace_begin();
+  int loaded = index_cache_load();
+  trace_end("index_cache_load", load_start, NULL);
+  if (loaded)
+  {
+    if (index_timing)
+      fprintf(stderr, "lush: index: %u entries, mapped from cache\n", strings.count);
+    trace_end("build_autocomplete_strings", build_start, NULL);
+    return;
+  }
 
-// Removes whitespace (' ', '\n', '\t')
-static char* skip_spaces(char *restrict p)
-{
-  while (is_whitespace(*p++));
-  return p - 1;
+  uint64_t start = now_ns();
+  path_dirs_scan();
+  trace_end("path_dirs_scan", start, NULL);
+  uint64_t publish_start = trace_begin();
+  strings_publish(now_ns() - start);
+  trace_end("strings_publish", publish_start, NULL);
+  uint64_t store_start = trace_begin();
+  index_cache_store();
+  trace_end("index_cache_store", store_start, NULL);
+  trace_end("build_autocomplete_strings", build_start, NULL);
 }
 
-static int is_whitespace(char c)
+// Rescans every dirty PATH directory on a small worker pool, one directory per task.
+// Directories own their `names` arena, so workers never share writes.
+static void path_dirs_scan()
 {
-  return c == ' ' || c == '\n' || c == '\t';
+  size_t dirty = 0;
+  for (size_t i = 0; i < watch.count; i++)
+    dirty += watch.dirs[i].dirty;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t workers = cpus < 1 ? 1 : MIN((size_t)cpus, PATH_SCAN_MAX_WORKERS);
+  workers = MIN(workers, dirty);
+
+  atomic_size_t next = 0;
+  pthread_t tids[PATH_SCAN_MAX_WORKERS];
+  size_t spawned = 0;
+  // The calling thread is a worker too. Helpers leave signals to the main thread.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  while (spawned + 1 < workers && pthread_create(&tids[spawned], NULL, path_scan_worker, &next) == 0)
+    spawned++;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  path_scan_worker(&next);
+  for (size_t i = 0; i < spawned; i++)
+    pthread_join(tids[i], NULL);
 }
 
-static int is_decimal_num(const char *restrict c)
+static void* path_scan_worker(void *next)
 {
-  char d;
-  if (*c == '-')
-    c++;
-  while ((d = *c++))
-    if (d < '0' || d > '9')
-      return 0;
-  return 1;
+  char *buf = malloc(GETDENTS_BUFFER_SIZE);
+  assert(buf && "malloc failed.");
+  size_t i;
+  while ((i = atomic_fetch_add((atomic_size_t*)next, 1)) < watch.count)
+    if (watch.dirs[i].dirty)
+      path_dir_scan(&watch.dirs[i], buf);
+  free(buf);
+  return 0;
 }
 
-// Returns the smallest index into `strings.offsets` such that
-// `strings.strings[strings.offsets[idx]]` starts with `target`
-// or -1 if no matches.
-static int32_t strings_binary_search(const char *restrict target)
+// Replaces `d`'s executable list with the current contents of its directory.
+// Reads entries in `GETDENTS_BUFFER_SIZE` batches and checks them against the dirfd,
+// so no full path is ever built.
+static void path_dir_scan(path_dir *restrict d, char *restrict buf)
 {
-  pthread_once(&strings_once, build_autocomplete_strings);
-  int32_t left = 0, right = strings.count;
-  while (left < right)
+  arena_reset(&d->names);
+  d->count = 0;
+  d->dirty = 0;
+
+  int dfd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  // Taken before reading: a change racing the scan leaves the cache stale, never wrong.
+  d->mtime = dir_mtime(dfd, d->path);
+  if (dfd == -1)
+    return;
+  ssize_t n;
+  while ((n = getdents64(dfd, buf, GETDENTS_BUFFER_SIZE)) > 0)
   {
-    int32_t m = (left + right) / 2;
-    int cmp = strcmp(target, strings.strings + strings.offsets[m]);
-    if (cmp < 0)
-      right = m;
-    else if (cmp > 0)
-      left = m + 1;
-    else return m;
+    for (char *p = buf; p < buf + n; p += ((struct dirent64*)p)->d_reclen)
+    {
+      const struct dirent64 *e = (const struct dirent64*)p;
+      // Skip hidden files.
+      if (e->d_name[0] == '.')
+        continue;
+      // Only store executable files.
+      struct statx st;
+      if (  ( (e->d_type == DT_REG) && (faccessat(dfd, e->d_name, X_OK, 0) == 0)  ) || // Fast path
+       (  (e->d_type == DT_LNK || e->d_type == DT_UNKNOWN) && (statx(dfd, e->d_name, 0, STATX_MODE, &st) == 0) && (S_ISREG(st.stx_mode) ) && (st.stx_mode & (S_IXUSR | S_IXGRP | S_IXOTH) ) ) )
+      {
+        size_t elen = strlen(e->d_name) + 1;
+        memcpy(arena_push(&d->names, alignof(char), elen), e->d_name, elen);
+        d->count++;
+      }
+    }
   }
-  return (left >= strings.count || (strncmp(target, strings.strings + strings.offsets[left], strlen(target)) != 0)) ? -1 : left;
+  close(dfd);
 }
 
-static void* init_once(void *_)
+// Rescans the PATH directories inotify reported as changed, then republishes `strings`.
+// Runs on the thread that reads `strings`, so swapping the block needs no locking.
+static void path_watch_poll()
 {
-  pthread_once(&strings_once, build_autocomplete_strings);
-  return 0;
+  if (watch.fd == -1)
+    return;
+
+  alignas(struct inotify_event) char buf[4 * KB];
+  int changed = 0;
+  ssize_t n;
+  while ((n = read(watch.fd, buf, sizeof(buf))) > 0)
+  {
+    for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len)
+    {
+      const struct inotify_event *ev = (const struct inotify_event*)p;
+      // Missed events: every directory is suspect.
+      if (ev->mask & IN_Q_OVERFLOW)
+        for (size_t i = 0; i < watch.count; i++)
+          watch.dirs[i].dirty = 1;
+      // The same directory may appear more than once in PATH.
+      for (size_t i = 0; i < watch.count; i++) if (watch.dirs[i].wd == ev->wd)
+      {
+        watch.dirs[i].dirty = 1;
+        if (ev->mask & IN_IGNORED)
+          watch.dirs[i].wd = -1;
+      }
+      changed = 1;
+    }
+  }
+  if (!changed)
+    return;
+
+  uint64_t start = now_ns();
+  path_dirs_scan();
+  strings_publish(now_ns() - start);
+  index_cache_store();
+  watch.generation++;
+  trace_end("path_watch_rescan", start, NULL);
 }
 
-static void build_autocomplete_strings()
+// Merges built-ins and every `watch.dirs` list into a new `strings` block, replacing the old one.
+// `scan_ns` is only used for `LUSH_TIMING` reports.
+static void strings_publish(uint64_t scan_ns)
 {
   /******************************************************
-   * Initialize temporary arenas.
+   * Collect entries.
    ******************************************************/
-  // Use a scratch arena for `temp_entry` and another for strings.
-  arena scratch_entry, scratch_string;
-  arena_init(&scratch_entry, 2 * MB);
-  arena_init(&scratch_string, 2 * MB);
+  size_t entry_count = Builtins_Size;
+  for (size_t i = 0; i < watch.count; i++)
+    entry_count += watch.dirs[i].count;
+  arena scratch_entry;
+  arena_init(&scratch_entry, entry_count * sizeof(temp_entry));
 
-  /******************************************************
-   * Collect strings.
-   ******************************************************/
   // Start with built-ins so they have precedence over PATH executables.
   for (int i = 0; i < Builtins_Size; i++)
   {
     temp_entry *e = ARENA_PUSH_TYPE(&scratch_entry, temp_entry);
-    size_t len = strlen(builtins[i]) + 1;
-    e->name = arena_push(&scratch_string, alignof(char), len);
-    memcpy(e->name, builtins[i], len);
-    e->full_path = NULL; // builtin marker
+    e->name = builtins[i];
+    e->dir = NULL; // builtin marker
   }
 
-  // Executables next.
-  char *PATH = getenv("PATH");
-  if (PATH)
+  // Executables next, in PATH order.
+  for (size_t i = 0; i < watch.count; i++)
   {
-    // PATH is immutable, so make a mutable copy.
-    size_t path_len = strlen(PATH) + 1;
-    char *path = arena_push(&scratch_string, alignof(char), path_len);
-    memcpy(path, PATH, path_len);
-
-    char *dir;
-    while ((dir = strsep(&path, PATH_LIST_SEPARATOR)))
+    const path_dir *d = &watch.dirs[i];
+    const char *name = d->names.data;
+    for (uint32_t j = 0; j < d->count; j++, name += strlen(name) + 1)
     {
-      DIR *d = opendir(dir);
-      struct dirent *e;
-      if (d)
-      {
-        size_t dlen = strlen(dir) + 1;
-        while ((e = readdir(d)))
-        {
-          // Skip hidden files.
-          if (e->d_name[0] != '.')
-          {
-            size_t elen = strlen(e->d_name) + 1;
-            size_t pop_len = scratch_string.len;
-            char *full = arena_push(&scratch_string, alignof(char), elen + dlen);
-            memcpy(full, dir, dlen);
-            full[dlen - 1] = '/';
-            memcpy(full + dlen, e->d_name, elen);
-
-            // Only store executable files.
-            struct stat st;
-            if (  ( (e->d_type == DT_REG) && (access(full, X_OK) == 0)  ) || // Fast path
-             (  (e->d_type == DT_REG && e->d_type == DT_UNKNOWN) && (stat(full, &st) == 0) && (S_ISREG(st.st_mode) ) && (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH) ) ) )
-            {
-              temp_entry *entry = ARENA_PUSH_TYPE(&scratch_entry, temp_entry);
-              entry->name = arena_push(&scratch_string, alignof(char), elen);
-              memcpy(entry->name, e->d_name, elen);
-              entry->full_path = full;
-            }
-            else scratch_string.len = pop_len; // Discard non-executable file paths.
-          }
-        }
-        closedir(d);
-      }
+      temp_entry *e = ARENA_PUSH_TYPE(&scratch_entry, temp_entry);
+      e->name = name;
+      e->dir = d;
     }
   }
 
   /******************************************************
    * Sort entries by their corresponding strings.
-   * Keep it stable using arena addresses.
+   * Stable, so built-ins and earlier PATH entries win ties.
    ******************************************************/
-  // TODO (long term): implement radix sort. This takes 1 ms already, but as practice.
-  // Make interface to `qsort()`.
-  size_t entry_count = scratch_entry.len / sizeof(temp_entry);
+  uint64_t sort_start = now_ns();
   temp_entry *entries = (temp_entry *)scratch_entry.data;
-  qsort(entries, entry_count, sizeof(temp_entry), temp_entry_cmp);
+  temp_entry *tmp = malloc(entry_count * sizeof(temp_entry));
+  assert(tmp && "malloc failed.");
+  temp_entry_radix_sort(entries, tmp, entry_count, 0);
+  free(tmp);
+  uint64_t sort_ns = now_ns() - sort_start;
 
   /******************************************************
    * Deduplicate in place and compute total string sizes.
@@ -895,8 +4463,8 @@ static void build_autocomplete_strings()
     {
       *write++ = *read;
       names_len_sum += strlen(read->name);
-      if (read->full_path) // Skip built-ins
-        paths_len_sum += strlen(read->full_path);
+      if (read->dir) // Skip built-ins
+        paths_len_sum += strlen(read->dir->path) + 1 + strlen(read->name);
     }
   size_t count = write - entries;
 
@@ -911,9 +4479,13 @@ static void build_autocomplete_strings()
   char *block = malloc(block_size);
   assert(block && "malloc failed ¯\\_(ツ)_/¯");
 
+  permanent_strings old = strings;
   strings.strings = block;
   strings.offsets = (int32_t*)(block + aligned_length);
   strings.count = count;
+  strings.size = block_size;
+  strings.map = NULL;
+  strings.map_size = 0;
 
   /******************************************************
    * Store sorted strings and offsets.
@@ -942,15 +4514,17 @@ static void build_autocomplete_strings()
     names += nlen;
 
     // Builtin flag
-    if (e.full_path)
+    if (e.dir)
     {
       // Must also fill in the other branch!
       path_offsets[i] = paths - block;
-      size_t plen = strlen(e.full_path) + 1;
+      size_t dlen = strlen(e.dir->path);
       // Done filling 4/5
-      memcpy(paths, e.full_path, plen);
+      memcpy(paths, e.dir->path, dlen);
+      paths[dlen] = '/';
+      memcpy(paths + dlen + 1, e.name, nlen);
       // Done tracking 5/5
-      paths += plen;
+      paths += dlen + 1 + nlen;
     }
     // Done filling 5/5
     else path_offsets[i] = builtin_msg_ptr - block;
@@ -960,43 +4534,671 @@ static void build_autocomplete_strings()
    * Memory cleanup.
    ******************************************************/
   arena_destroy(&scratch_entry);
-  arena_destroy(&scratch_string);
+  strings_release(&old);
+  strings_derive();
+
+  if (index_timing)
+    fprintf(stderr, "lush: index: %u entries, scan %.3f ms, sort %.3f ms\n", strings.count, scan_ns / 1e6, sort_ns / 1e6);
 }
 
-static int temp_entry_cmp(const void *a, const void *b)
+// Stable MSD radix sort of `e` by name, looking at bytes from `depth` on.
+// `tmp` is scratch space for at least `n` entries.
+static void temp_entry_radix_sort(temp_entry *restrict e, temp_entry *restrict tmp, size_t n, size_t depth)
 {
-  const temp_entry *ea = a;
-  const temp_entry *eb = b;
-  int cmp = strcmp(ea->name, eb->name);
-  // Address implies insertion order in arena.
-  return cmp ? cmp : ea < eb ? -1 : ea > eb;
-};
+  for (;;)
+  {
+    // Small buckets: insertion sort, also stable.
+    if (n <= RADIX_SORT_CUTOFF)
+    {
+      for (size_t i = 1; i < n; i++)
+      {
+        temp_entry x = e[i];
+        size_t j = i;
+        for (; j > 0 && strcmp(e[j-1].name + depth, x.name + depth) > 0; j--)
+          e[j] = e[j-1];
+        e[j] = x;
+      }
+      return;
+    }
+
+    size_t count[EXTENDED_ASCII] = {0};
+    for (size_t i = 0; i < n; i++)
+      count[(unsigned char)e[i].name[depth]]++;
+    // Names ended: ties keep insertion order.
+    if (count[0] == n)
+      return;
+    // Shared byte: nothing to move, look at the next one.
+    if (count[(unsigned char)e[0].name[depth]] == n)
+    {
+      depth++;
+      continue;
+    }
+
+    size_t start[EXTENDED_ASCII];
+    for (size_t c = 0, sum = 0; c < EXTENDED_ASCII; c++)
+    {
+      start[c] = sum;
+      sum += count[c];
+    }
+    for (size_t i = 0; i < n; i++)
+      tmp[start[(unsigned char)e[i].name[depth]]++] = e[i];
+    memcpy(e, tmp, n * sizeof(temp_entry));
+
+    // `start[c]` now marks the end of bucket c. Bucket 0 is fully sorted.
+    for (size_t c = 1; c < EXTENDED_ASCII; c++) if (count[c] > 1)
+      temp_entry_radix_sort(e + start[c] - count[c], tmp, count[c], depth + 1);
+    return;
+  }
+}
+
+static void strings_release(permanent_strings *restrict s)
+{
+  if (s->map)
+    munmap(s->map, s->map_size);
+  else free(s->strings);
+  *s = (permanent_strings){0};
+}
+
+// Writes the index cache location into `buf`: `LUSH_INDEX_CACHE`, else under
+// `XDG_CACHE_HOME` or `~/.cache`. Returns 0 when there is none.
+static int index_cache_path(char *restrict buf, size_t size)
+{
+  const char *env;
+  int len;
+  if ((env = var_get("LUSH_INDEX_CACHE")))
+    len = snprintf(buf, size, "%s", env);
+  else if ((env = var_get("XDG_CACHE_HOME")) && *env)
+    len = snprintf(buf, size, "%s/" INDEX_CACHE_NAME, env);
+  else if ((env = var_get("HOME")))
+  {
+    // Best effort: the directory may not exist yet.
+    len = snprintf(buf, size, "%s/.cache", env);
+    if (len > 0 && len < size)
+      mkdir(buf, 0755);
+    len = snprintf(buf, size, "%s/.cache/" INDEX_CACHE_NAME, env);
+  }
+  else return 0;
+  return *buf && len > 0 && len < size;
+}
+
+// Maps the index cache read-only into `strings` if it matches PATH and every directory's mtime,
+// and copies back each directory's names. Fills `watch.dirs[i].mtime` either way. Returns 1 on success.
+static int index_cache_load()
+{
+  for (size_t i = 0; i < watch.count; i++)
+    watch.dirs[i].mtime = dir_mtime(-1, watch.dirs[i].path);
+
+  const char *PATH = var_get("PATH");
+  char file[PATH_MAX];
+  if (!PATH || !index_cache_path(file, sizeof(file)))
+    return 0;
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(index_cache_header))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  const index_cache_header *h = map;
+  const char *path = (const char*)(h + 1);
+  size_t size = st.st_size;
+  int valid = h->magic == INDEX_CACHE_MAGIC &&
+    h->builtins_hash == builtins_hash() &&
+    h->dir_count == watch.count &&
+    h->path_len == strlen(PATH) + 1 &&
+    sizeof(*h) + h->path_len + h->dir_count * sizeof(index_cache_dir) <= h->block_offset &&
+    h->block_offset % alignof(int32_t) == 0 &&
+    h->block_offset + h->block_size <= h->names_offset &&
+    h->names_offset + h->names_size <= size &&
+    h->block_size >= sizeof(int32_t) * 2 * (uint64_t)h->count &&
+    memcmp(path, PATH, h->path_len) == 0;
+  const index_cache_dir *dirs = (const index_cache_dir*)(path + h->path_len);
+  uint64_t names_size = 0;
+  for (size_t i = 0; valid && i < watch.count; i++)
+  {
+    valid = memcmp(&dirs[i].mtime, &watch.dirs[i].mtime, sizeof(index_cache_mtime)) == 0;
+    names_size += dirs[i].names_size;
+  }
+  if (!valid || names_size != h->names_size)
+  {
+    munmap(map, size);
+    return 0;
+  }
+
+  // Each directory's names, in `readdir` order as last scanned.
+  const char *names = (const char*)map + h->names_offset;
+  for (size_t i = 0; i < watch.count; i++)
+  {
+    path_dir *d = &watch.dirs[i];
+    memcpy(arena_push(&d->names, alignof(char), dirs[i].names_size), names, dirs[i].names_size);
+    names += dirs[i].names_size;
+    d->count = dirs[i].count;
+    d->dirty = 0;
+  }
+
+  char *block = (char*)map + h->block_offset;
+  strings = (permanent_strings){
+    .strings = block,
+    .offsets = (int32_t*)(block + h->block_size - sizeof(int32_t) * 2 * h->count),
+    .count = h->count,
+    .size = h->block_size,
+    .map = map,
+    .map_size = size,
+  };
+  strings_derive();
+  return 1;
+}
+
+// Persists `strings` for the next shell. Written to a temporary file and renamed,
+// so concurrent shells only ever map complete caches.
+static void index_cache_store()
+{
+  char file[PATH_MAX], tmp[PATH_MAX + 8];
+  if (!index_cache_path(file, sizeof(file)))
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+  int fd = mkostemp(tmp, O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  const char *PATH = watch.path ? var_get("PATH") : "";
+  index_cache_header h = {
+    .magic = INDEX_CACHE_MAGIC,
+    .count = strings.count,
+    .builtins_hash = builtins_hash(),
+    .path_len = strlen(PATH) + 1,
+    .dir_count = watch.count,
+    .block_size = strings.size,
+  };
+  size_t dirs_offset = sizeof(h) + h.path_len;
+  h.block_offset = ALIGN_UP(dirs_offset + watch.count * sizeof(index_cache_dir), alignof(uint64_t));
+  h.names_offset = h.block_offset + h.block_size;
+  for (size_t i = 0; i < watch.count; i++)
+    h.names_size += watch.dirs[i].names.len;
+
+  char *buf = calloc(1, h.block_offset);
+  int ok = buf != NULL;
+  if (ok)
+  {
+    memcpy(buf, &h, sizeof(h));
+    memcpy(buf + sizeof(h), PATH, h.path_len);
+    for (size_t i = 0; i < watch.count; i++)
+    {
+      const path_dir *d = &watch.dirs[i];
+      index_cache_dir dir = {.mtime = d->mtime, .names_size = d->names.len, .count = d->count};
+      memcpy(buf + dirs_offset + i * sizeof(index_cache_dir), &dir, sizeof(dir));
+    }
+    ok = write_all(fd, buf, h.block_offset) && write_all(fd, strings.strings, h.block_size);
+    for (size_t i = 0; ok && i < watch.count; i++)
+      ok = write_all(fd, watch.dirs[i].names.data, watch.dirs[i].names.len);
+  }
+  free(buf);
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp, file) != 0)
+    unlink(tmp);
+}
+
+// FNV-1a over the builtin names: a cache written by a build with other builtins is stale.
+static uint64_t builtins_hash()
+{
+  uint64_t h = 0xcbf29ce484222325;
+  for (int i = 0; i < Builtins_Size; i++)
+    for (const char *c = builtins[i]; ; c++)
+    {
+      h = (h ^ (unsigned char)*c) * 0x100000001b3;
+      if (!*c)
+        break;
+    }
+  return h;
+}
+
+// FNV-1a.
+static uint64_t hash_bytes(const char *restrict s, size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 0x100000001b3;
+  return h;
+}
+
+// Opens the trace file and turns every probe on. Events are flushed at exit.
+static void trace_start(const char *restrict path)
+{
+  trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (trace.fd == -1)
+  {
+    fprintf(stderr, "lush: LUSH_TRACE: %s: %s\n", path, strerror(errno));
+    return;
+  }
+  trace.events = malloc(TRACE_BUFFER_EVENTS * sizeof(trace_event));
+  assert(trace.events && "Out of memory for trace.");
+  trace.pid = getpid();
+  write_all(trace.fd, "[\n", 2);
+  atexit(trace_close);
+}
+
+// Start time of a phase, or 0 when tracing is off.
+static uint64_t trace_begin()
+{
+  return trace.events ? now_ns() : 0;
+}
+
+// Records phase `name` from `start` until now. Free when tracing is off.
+static void trace_end(const char *restrict name, uint64_t start, const char *restrict detail)
+{
+  if (!trace.events)
+    return;
+  uint64_t end = now_ns();
+  if (!trace_tid)
+    trace_tid = gettid();
+  pthread_mutex_lock(&trace.lock);
+  if (!trace.closed)
+  {
+    trace_event *e = &trace.events[trace.count++];
+    e->name = name;
+    e->start = start;
+    e->end = end;
+    e->tid = trace_tid;
+    snprintf(e->detail, sizeof(e->detail), "%s", detail ? detail : "");
+    if (trace.count == TRACE_BUFFER_EVENTS)
+      trace_flush();
+  }
+  pthread_mutex_unlock(&trace.lock);
+}
+
+// Appends the buffered events as JSON. Called with `lock` held.
+static void trace_flush()
+{
+  // A forked builtin's copy of the buffer belongs to its parent.
+  if (getpid() != trace.pid)
+  {
+    trace.count = 0;
+    return;
+  }
+  char buf[256];
+  for (size_t i = 0; i < trace.count; i++)
+  {
+    const trace_event *e = &trace.events[i];
+    int n = snprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"",
+                     trace.written++ ? ",\n" : "", e->name,
+                     (unsigned long long)(e->start / 1000), (unsigned)(e->start % 1000),
+                     (unsigned long long)((e->end - e->start) / 1000), (unsigned)((e->end - e->start) % 1000),
+                     trace.pid, e->tid);
+    // Commands are user input: escape them.
+    for (const char *c = e->detail; *c && n < (int)sizeof(buf) - 16; c++)
+    {
+      if (*c == '"' || *c == '\\')
+        n += sprintf(buf + n, "\\%c", *c);
+      else if ((unsigned char)*c < ' ')
+        n += sprintf(buf + n, "\\u%04x", *c);
+      else buf[n++] = *c;
+    }
+    n += sprintf(buf + n, "\"}}");
+    write_all(trace.fd, buf, n);
+  }
+  trace.count = 0;
+}
+
+// `atexit`: writes what is left and closes the JSON array. Later events are dropped.
+static void trace_close()
+{
+  if (getpid() != trace.pid)
+    return;
+  pthread_mutex_lock(&trace.lock);
+  trace_flush();
+  write_all(trace.fd, "\n]\n", 3);
+  close(trace.fd);
+  trace.closed = 1;
+  pthread_mutex_unlock(&trace.lock);
+}
+
+// mtime of the directory open at `fd`, or at `path` when `fd` is -1.
+static index_cache_mtime dir_mtime(int fd, const char *restrict path)
+{
+  struct stat st;
+  if ((fd == -1 ? stat(path, &st) : fstat(fd, &st)) != 0)
+    return (index_cache_mtime){-1, -1};
+  return (index_cache_mtime){st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
+// Hands readline every command matching `text` at once: the trie gives the sorted
+// match range and its longest common prefix without comparing candidates.
 static char **attempted_completion_function(const char *restrict text, int start, int end)
 {
-  return start ? NULL : rl_completion_matches(text, completion_matches_generator);
+  rl_sort_completion_matches = 1;
+  // Arguments, and commands given by path.
+  if (start || strchr(text, '/'))
+    return path_completion(text);
+  strings_ready();
+  size_t len = strlen(text);
+  int32_t n = trie_find(text, len);
+  if (n == -1)
+    return NULL;
+
+  const trie_node *node = &trie.nodes[n];
+  uint32_t count = node->hi - node->lo;
+  char **matches = malloc((count + 2) * sizeof(char*));
+  assert(matches && "malloc failed.");
+  // matches[0] is the text to substitute: the lone match, or the common prefix of all.
+  const char *first = strings.strings + strings.offsets[node->lo];
+  matches[0] = count == 1 ? strdup(first) : strndup(first, node->depth);
+  uint32_t m = 1;
+  if (count > 1)
+    for (uint32_t i = node->lo; i < node->hi; i++)
+      matches[m++] = strdup(strings.strings + strings.offsets[i]);
+  matches[m] = NULL;
+  rl_sort_completion_matches = 0; // Already sorted.
+  return matches;
+}
+
+// Completes a path from the cached listing of its directory, never reading the directory here.
+// Waits `DIR_LISTING_WAIT_MS` at most for a missing or changed listing, then makes do with
+// the old one, or with nothing. `~` paths are left to Readline.
+static char** path_completion(const char *restrict text)
+{
+  if (text[0] == '~')
+    return NULL;
+  rl_attempted_completion_over = 1;
+  rl_filename_completion_desired = 1;
+  const char *slash = strrchr(text, '/');
+  size_t dir_len = slash ? slash - text + 1 : 0;
+  const char *prefix = text + dir_len;
+  size_t prefix_len = strlen(prefix);
+  char key[PATH_MAX];
+  if (!dir_listing_key(text, dir_len, key))
+    return NULL;
+  index_cache_mtime mtime = dir_mtime(-1, key);
+  pthread_once(&listings.once, dir_listing_start);
+
+  pthread_mutex_lock(&listings.lock);
+  dir_listing *l = dir_listing_request(key, mtime);
+  if (l && l->state != Listing_Ready)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += DIR_LISTING_WAIT_MS * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (l->state != Listing_Ready && pthread_cond_timedwait(&listings.ready, &listings.lock, &deadline) == 0)
+      ;
+  }
+  if (!l || !l->strings)
+  {
+    pthread_mutex_unlock(&listings.lock);
+    return NULL;
+  }
+
+  // Names starting with `prefix` are one sorted range.
+  uint32_t lo = 0, hi = l->count;
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (strcmp(l->strings + l->offsets[mid], prefix) < 0)
+      lo = mid + 1;
+    else hi = mid;
+  }
+  char **matches = malloc((l->count - lo + 2) * sizeof(char*));
+  assert(matches && "malloc failed.");
+  uint32_t m = 1;
+  size_t common = 0;
+  for (uint32_t i = lo; i < l->count; i++)
+  {
+    const char *name = l->strings + l->offsets[i];
+    if (strncmp(name, prefix, prefix_len) != 0)
+      break;
+    // Hidden files only when asked for.
+    if (name[0] == '.' && prefix[0] != '.')
+      continue;
+    size_t len = strlen(name);
+    char *match = malloc(dir_len + len + 1);
+    assert(match && "malloc failed.");
+    memcpy(match, text, dir_len);
+    memcpy(match + dir_len, name, len + 1);
+    if (m == 1)
+      common = dir_len + len;
+    else for (size_t k = dir_len + prefix_len; k < common; k++)
+      if (match[k] != matches[1][k])
+        common = k;
+    matches[m++] = match;
+  }
+  pthread_mutex_unlock(&listings.lock);
+
+  if (m == 1)
+  {
+    free(matches);
+    return NULL;
+  }
+  matches[0] = m == 2 ? strdup(matches[1]) : strndup(matches[1], common);
+  if (m == 2)
+  {
+    free(matches[1]);
+    m = 1;
+  }
+  matches[m] = NULL;
+  rl_sort_completion_matches = 0; // Already sorted.
+  return matches;
+}
+
+// Absolute path of the directory `dir[0..len)`, relative to the cwd, without a trailing slash.
+// Returns 0 when it does not fit in `PATH_MAX`.
+static int dir_listing_key(const char *restrict dir, size_t len, char *restrict key)
+{
+  size_t n = 0;
+  if (dir[0] != '/')
+  {
+    if (!getcwd(key, PATH_MAX))
+      return 0;
+    n = strlen(key);
+  }
+  if (n + 1 + len >= PATH_MAX)
+    return 0;
+  if (len && n && key[n-1] != '/')
+    key[n++] = '/';
+  memcpy(key + n, dir, len);
+  n += len;
+  while (n > 1 && key[n-1] == '/')
+    n--;
+  key[n] = '\0';
+  return 1;
 }
 
-static char *completion_matches_generator(const char *restrict text, int state)
+// Slot of `key`, queued for the worker to load unless it is ready as of `mtime`, the directory's
+// current one. Evicts the least recently used idle slot for a new key; NULL when every slot is busy.
+// Called with `listings.lock` held.
+static dir_listing* dir_listing_request(const char *restrict key, index_cache_mtime mtime)
 {
-  static int32_t idx, len;
-  if (!state)
+  dir_listing *l = NULL, *victim = NULL;
+  for (int i = 0; i < DIR_LISTING_SLOTS && !l; i++)
+  {
+    dir_listing *s = &listings.slots[i];
+    if (s->path && strcmp(s->path, key) == 0)
+      l = s;
+    else if (s->state == Listing_Free || (s->state == Listing_Ready && (!victim || (victim->state != Listing_Free && s->used < victim->used))))
+      victim = s;
+  }
+  if (!l)
   {
-    if ((idx = strings_binary_search(text)) == -1)
+    if (!(l = victim))
       return NULL;
-    else
-      len = strlen(text);
+    free(l->path);
+    free(l->strings);
+    *l = (dir_listing){.path = strdup(key)};
+    assert(l->path && "strdup failed.");
   }
-  char *candidate = strings.strings + strings.offsets[idx++];
-  if (idx <= strings.count && strncmp(text, candidate, len) == 0)
-    return strdup(candidate);
-  return NULL;
+  l->used = now_ns();
+  int stale = !l->strings || memcmp(&l->mtime, &mtime, sizeof(mtime)) != 0;
+  if (l->state == Listing_Free || (l->state == Listing_Ready && stale))
+  {
+    l->state = Listing_Queued;
+    pthread_cond_signal(&listings.queued);
+  }
+  return l;
+}
+
+// Has the worker load or revalidate the listing of `dir[0..len)` without waiting for it.
+static void dir_listing_prefetch(const char *restrict dir, size_t len)
+{
+  char key[PATH_MAX];
+  if (!dir_listing_key(dir, len, key))
+    return;
+  index_cache_mtime mtime = dir_mtime(-1, key);
+  pthread_once(&listings.once, dir_listing_start);
+  pthread_mutex_lock(&listings.lock);
+  dir_listing_request(key, mtime);
+  pthread_mutex_unlock(&listings.lock);
+}
+
+static void dir_listing_start()
+{
+  pthread_t tid;
+  // Signals are for the main thread.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if (pthread_create(&tid, NULL, dir_listing_worker, NULL) == 0)
+    pthread_detach(tid);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Loads queued listings one at a time, reading directories outside the lock.
+static void* dir_listing_worker(void*)
+{
+  char *buf = malloc(GETDENTS_BUFFER_SIZE);
+  assert(buf && "malloc failed.");
+  arena names;
+  arena_virtual_init(&names, PATH_DIR_ARENA_RESERVE);
+  pthread_mutex_lock(&listings.lock);
+  for (;;)
+  {
+    dir_listing *l = NULL;
+    for (int i = 0; i < DIR_LISTING_SLOTS && !l; i++)
+      if (listings.slots[i].state == Listing_Queued)
+        l = &listings.slots[i];
+    if (!l)
+    {
+      pthread_cond_wait(&listings.queued, &listings.lock);
+      continue;
+    }
+    // Loading slots are never evicted, so `l` stays ours.
+    l->state = Listing_Loading;
+    pthread_mutex_unlock(&listings.lock);
+    uint64_t start = trace_begin();
+    dir_listing_load(l, buf, &names);
+    trace_end("dir_listing_load", start, l->path);
+    pthread_mutex_lock(&listings.lock);
+    l->state = Listing_Ready;
+    pthread_cond_broadcast(&listings.ready);
+  }
+  return 0;
+}
+
+// Replaces `l`'s listing when its directory changed since the last load.
+// Only the swap of the block happens under `listings.lock`.
+static void dir_listing_load(dir_listing *restrict l, char *restrict buf, arena *restrict names)
+{
+  int dfd = open(l->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  // Taken before reading: a change racing the load is seen by the next one.
+  index_cache_mtime mtime = dir_mtime(dfd, l->path);
+  if (l->strings && memcmp(&mtime, &l->mtime, sizeof(mtime)) == 0)
+  {
+    if (dfd != -1)
+      close(dfd);
+    return;
+  }
+  arena_reset(names);
+  size_t count = 0, bytes = 0;
+  ssize_t n;
+  while (dfd != -1 && (n = getdents64(dfd, buf, GETDENTS_BUFFER_SIZE)) > 0)
+    for (char *p = buf; p < buf + n; p += ((struct dirent64*)p)->d_reclen)
+    {
+      const char *name = ((const struct dirent64*)p)->d_name;
+      if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        continue;
+      size_t len = strlen(name) + 1;
+      memcpy(arena_push(names, alignof(char), len), name, len);
+      bytes += len;
+      count++;
+    }
+  if (dfd != -1)
+    close(dfd);
+
+  // Same sort as the PATH index.
+  temp_entry *entries = malloc(2 * count * sizeof(temp_entry) + 1);
+  assert(entries && "malloc failed.");
+  const char *name = names->data;
+  for (size_t i = 0; i < count; i++, name += strlen(name) + 1)
+    entries[i] = (temp_entry){.name = name};
+  temp_entry_radix_sort(entries, entries + count, count, 0);
+
+  size_t aligned = ALIGN_UP(bytes, alignof(int32_t));
+  char *block = malloc(aligned + count * sizeof(int32_t) + 1);
+  assert(block && "malloc failed.");
+  int32_t *offsets = (int32_t*)(block + aligned);
+  char *w = block;
+  for (size_t i = 0; i < count; i++)
+  {
+    size_t len = strlen(entries[i].name) + 1;
+    offsets[i] = w - block;
+    memcpy(w, entries[i].name, len);
+    w += len;
+  }
+  free(entries);
+
+  pthread_mutex_lock(&listings.lock);
+  char *old = l->strings;
+  l->strings = block;
+  l->offsets = offsets;
+  l->count = count;
+  l->mtime = mtime;
+  pthread_mutex_unlock(&listings.lock);
+  free(old);
+}
+
+// `rl_pre_input_hook`: the cwd is the likeliest directory to complete in.
+static int prompt_prefetch()
+{
+  dir_listing_prefetch("", 0);
+  listings.typed[0] = '\0';
+  return 0;
+}
+
+// `rl_getc_function`: before waiting for each key, prefetches the directory of the word
+// under the cursor once it has a slash, so the listing is ready by the time Tab comes.
+static int typing_prefetch(FILE *stream)
+{
+  int word = rl_point;
+  while (word > 0 && !is_whitespace(rl_line_buffer[word - 1]))
+    word--;
+  int slash = rl_point;
+  while (slash > word && rl_line_buffer[slash - 1] != '/')
+    slash--;
+  size_t len = slash - word;
+  const char *dir = rl_line_buffer + word;
+  if (len && len < PATH_MAX && dir[0] != '~' && (strncmp(listings.typed, dir, len) != 0 || listings.typed[len]))
+  {
+    memcpy(listings.typed, dir, len);
+    listings.typed[len] = '\0';
+    dir_listing_prefetch(dir, len);
+  }
+  return rl_getc(stream);
 }
 
 static void arena_init(arena *restrict arena, size_t size)
 {
   arena->data = malloc(size);
   arena->capacity = size;
+  arena->reserved = 0;
   arena->len = 0;
   if (!arena->data)
   {
@@ -1005,6 +5207,41 @@ static void arena_init(arena *restrict arena, size_t size)
   }
 }
 
+static void arena_virtual_init(arena *restrict arena, size_t reserve)
+{
+  arena->data = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (arena->data == MAP_FAILED)
+  {
+    fprintf(stderr, "Failed reserving %zu bytes for arena.\n", reserve);
+    exit(1);
+  }
+  arena->reserved = reserve;
+  arena->capacity = 0;
+  arena->len = 0;
+  arena_commit(arena, ARENA_DEFAULT_SIZE);
+}
+
+// Commits a virtual arena up to at least `size` bytes, in `ARENA_COMMIT_GRANULE` steps.
+static void arena_commit(arena *restrict arena, size_t size)
+{
+  assert((size <= arena->reserved) && "arena overflowed its reservation");
+  size_t capacity = MIN(ALIGN_UP(size, ARENA_COMMIT_GRANULE), arena->reserved);
+  int err = mprotect(arena->data + arena->capacity, capacity - arena->capacity, PROT_READ | PROT_WRITE);
+  assert((err == 0) && "Failed committing arena pages.");
+  arena->capacity = capacity;
+}
+
+// Decommits a virtual arena down to `keep` bytes, returning the pages to the OS.
+static void arena_trim(arena *restrict arena, size_t keep)
+{
+  keep = ALIGN_UP(keep, ARENA_COMMIT_GRANULE);
+  if (!arena->reserved || arena->capacity <= keep || arena->len > keep)
+    return;
+  madvise(arena->data + keep, arena->capacity - keep, MADV_DONTNEED);
+  mprotect(arena->data + keep, arena->capacity - keep, PROT_NONE);
+  arena->capacity = keep;
+}
+
 static void arena_exponential_init(arena_exponential *restrict arena, size_t size)
 {
   arena->room[0] = malloc(size);
@@ -1019,14 +5256,21 @@ static void arena_exponential_init(arena_exponential *restrict arena, size_t siz
   }
 }
 
-static void arena_destroy(arena *restrict arena) { free(arena->data); }
+static void arena_destroy(arena *restrict arena)
+{
+  if (arena->reserved)
+    munmap(arena->data, arena->reserved);
+  else free(arena->data);
+}
 
-static void* arena_push(arena *restrict arena, size_t alignment, size_t size)
+static inline void* arena_push(arena *restrict arena, size_t alignment, size_t size)
 {
   size_t bit_mask = alignment - 1;
   assert((alignment != 0) && ((alignment & bit_mask) == 0) && "alignment must be a power of two");
 
   size_t aligned_length = (arena->len + bit_mask) & ~bit_mask;
+  if (arena->reserved && arena->capacity < aligned_length + size)
+    arena_commit(arena, aligned_length + size);
   assert((arena->capacity >= aligned_length + size) && "arena overflowed");
 
   arena->len = aligned_length + size;
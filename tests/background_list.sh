@@ -0,0 +1,11 @@
+#!/bin/sh
+# `a && b &` runs the whole list as one background job, not just `b`. Usage: background_list.sh <shell>
+shell="$1"
+out=$(printf '%s\n' 'sleep 0.3 && echo b &' 'echo a' 'jobs' 'sleep 0.6' | "$shell" 2>&1)
+expected="a
+[1]+  Running                 sleep 0.3 && echo b &
+b"
+if [ "$out" != "$expected" ]; then
+  printf 'expected:\n%s\ngot:\n%s\n' "$expected" "$out"
+  exit 1
+fi
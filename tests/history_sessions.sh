@@ -0,0 +1,32 @@
+#!/bin/sh
+# `history -w` in one session leaves another session's mapped HISTFILE readable.
+# A HISTFILE of one newline loads as empty.
+# Usage: history_sessions.sh <shell>
+shell="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+seq 1 20000 | sed 's/^/echo line /' > "$dir/histfile"
+: > "$dir/empty"
+# Session A maps HISTFILE at startup and lists its tail after B rewrote it.
+(sleep 0.3; echo 'history 3'; sleep 0.3; echo exit) \
+  | HISTFILE="$dir/histfile" timeout 5 script -qec "$shell" /dev/null > "$dir/a" &
+sleep 0.15
+echo "history -w $dir/histfile" | HISTFILE="$dir/empty" "$shell"
+wait $! || { echo "session A failed"; exit 1; }
+for line in '19999  echo line 19999' '20000  echo line 20000'; do
+  if ! tr -d '\r' < "$dir/a" | grep -qF "$line"; then
+    printf 'missing "%s" in:\n' "$line"
+    cat "$dir/a"
+    exit 1
+  fi
+done
+# A HISTFILE of a single newline starts like an empty one.
+printf '\n' > "$dir/newline"
+(sleep 0.3; echo 'echo started'; sleep 0.3; echo exit) \
+  | HISTFILE="$dir/newline" timeout 5 script -qec "$shell" /dev/null > "$dir/b" \
+  || { echo "session with a one-newline HISTFILE failed"; cat "$dir/b"; exit 1; }
+if ! tr -d '\r' < "$dir/b" | grep -v 'echo started' | grep -q 'started'; then
+  echo 'missing "started" in:'
+  cat "$dir/b"
+  exit 1
+fi
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Lines with no words, dangling links and redirections without a target run as empty
+# instead of aborting. Usage: parse.sh <shell>
+shell="$1"
+out=$(printf '%s\n' '$UNSET_VAR' 'echo a |' 'echo $?' '&& echo b' 'echo c' 'echo d > $UNSET_VAR' 'echo $?' | "$shell" 2>&1)
+expected="lush: syntax error near \`|'
+2
+lush: syntax error near \`&&'
+c
+lush: ambiguous redirect
+1"
+if [ "$out" != "$expected" ]; then
+  printf 'expected:\n%s\ngot:\n%s\n' "$expected" "$out"
+  exit 1
+fi
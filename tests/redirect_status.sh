@@ -0,0 +1,18 @@
+#!/bin/sh
+# A redirection that cannot be opened is reported by its path with status 1 in every
+# spawn backend; a missing command stays 127. Usage: redirect_status.sh <shell>
+shell="$1"
+expected="lush: /nonexistent/x: No such file or directory
+1
+lush: /nonexistent/x: No such file or directory
+1
+nosuchcmd_lush: command not found
+127"
+for backend in posix_spawn vfork fork; do
+  out=$(printf '%s\n' 'ls > /nonexistent/x' 'echo $?' 'echo a | cat > /nonexistent/x' 'echo $?' 'nosuchcmd_lush' 'echo $?' |
+    LUSH_SPAWN=$backend "$shell" 2>&1)
+  if [ "$out" != "$expected" ]; then
+    printf '%s: expected:\n%s\ngot:\n%s\n' "$backend" "$expected" "$out"
+    exit 1
+  fi
+done
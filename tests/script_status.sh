@@ -0,0 +1,20 @@
+#!/bin/sh
+# Script mode exits with the status of the last command. Usage: script_status.sh <shell>
+shell="$1"
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+printf 'true\nfalse\n' > "$script"
+printf 'false\n' | "$shell"; piped=$?
+"$shell" "$script"; file=$?
+printf 'false\ntrue\n' | "$shell"; last=$?
+if [ "$piped $file $last" != "1 1 0" ]; then
+  printf 'expected: 1 1 0\ngot: %s\n' "$piped $file $last"
+  exit 1
+fi
+# An unterminated trailing comment in a mapped file is skipped, not run.
+printf 'true\n# trailing comment' > "$script"
+out=$("$shell" "$script" 2>&1); comment=$?
+if [ "$comment" != 0 ] || [ -n "$out" ]; then
+  printf 'expected: 0 and no output\ngot: %s %s\n' "$comment" "$out"
+  exit 1
+fi
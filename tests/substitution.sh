@@ -0,0 +1,21 @@
+#!/bin/sh
+# Nested `$(...)` whose inner output spans many tokens, and assignments that stay
+# inside the substitution. Usage: substitution.sh <shell>
+shell="$1"
+out=$(printf '%s\n' \
+  'echo $(echo $(seq 1 100))' \
+  'echo "$(echo "$(seq 1 3)" x $(echo a b))"' \
+  'echo a$(echo `echo b` $(seq 2))c' \
+  'echo x$(FOO=leaked)y' \
+  'echo "[$FOO]"' | "$shell")
+expected="$(seq 1 100 | tr '\n' ' ' | sed 's/ $//')
+1
+2
+3 x a b
+ab 1 2c
+xy
+[]"
+if [ "$out" != "$expected" ]; then
+  printf 'expected:\n%s\ngot:\n%s\n' "$expected" "$out"
+  exit 1
+fi
@@ -0,0 +1,18 @@
+#!/bin/sh
+# `time` on a pipeline reaps every stage even when pidfds run out, and reports a command
+# that never ran. Usage: time_pipeline.sh <shell>
+shell="$1"
+out=$(ulimit -n 12; printf '%s\n' 'time true | cat | cat | cat | cat | cat | cat | cat | cat' 'echo done' \
+  | timeout 5 "$shell" 2>/dev/null)
+if [ "$out" != "done" ]; then
+  printf 'expected:\ndone\ngot:\n%s\n' "$out"
+  exit 1
+fi
+# A timed command that is not found is still reported, as a row of dashes.
+out=$(printf '%s\n' 'time nosuchcmd_lush' 'echo $?' | "$shell" 2>&1 | tail -2 | tr -s ' ')
+expected="1 - - - - - - nosuchcmd_lush
+127"
+if [ "$out" != "$expected" ]; then
+  printf 'expected:\n%s\ngot:\n%s\n' "$expected" "$out"
+  exit 1
+fi